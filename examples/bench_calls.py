@@ -0,0 +1,69 @@
+"""per-call overhead of the cheap, frequent Otama calls.
+
+run it against two builds (e.g. before and after a change to the call
+path) and compare the ns/call columns:
+
+    $ python bench_calls.py [-n NUMBER]
+"""
+import os
+import sys
+import shutil
+import timeit
+import argparse
+import tempfile
+from otama import Otama
+
+BASE_DIR = os.path.abspath(os.path.dirname(__file__))
+TARGET_FILE1 = os.path.join(BASE_DIR, 'image/lena.jpg')
+TARGET_FILE2 = os.path.join(BASE_DIR, 'image/lena-affine.jpg')
+
+
+def bench(name, func, number):
+    try:
+        func()
+    except TypeError:
+        print("%-32s %10s" % (name, "n/a"))
+        return
+    best = min(timeit.repeat(func, number=number, repeat=5))
+    print("%-32s %10.1f ns/call" % (name, best / number * 1e9))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-n', '--number', type=int, default=100000)
+    number = parser.parse_args().number
+
+    data_dir = tempfile.mkdtemp()
+    config = {
+        'namespace': 'bench',
+        'driver': {'name': 'color', 'data_dir': data_dir},
+        'database': {'driver': 'sqlite3',
+                     'name': os.path.join(data_dir, 'bench.db')}}
+    try:
+        db = Otama(config)
+        db.create_database()
+        id_ = db.insert(TARGET_FILE1)
+        db.pull()
+        fv1 = db.feature_raw({'file': TARGET_FILE1})
+        fv2 = db.feature_raw({'file': TARGET_FILE2})
+        q1, q2 = {'raw': fv1}, {'raw': fv2}
+
+        print("python %s" % sys.version.split()[0])
+        bench("exists(id)", lambda: db.exists(id_), number)
+        bench("exists(id=id)", lambda: db.exists(id=id_), number)
+        bench("similarity(raw, raw)", lambda: db.similarity(q1, q2), number)
+        bench("search(1, raw)", lambda: db.search(1, q1), max(number // 10, 1))
+        bench("search(num=1, data=raw)",
+              lambda: db.search(num=1, data=q1), max(number // 10, 1))
+        bench("Otama(config) + close()",
+              lambda: Otama(config).close(), max(number // 100, 1))
+
+        fv1.dispose()
+        fv2.dispose()
+        db.close()
+    finally:
+        shutil.rmtree(data_dir)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,66 @@
+"""search throughput of many threads querying the same few images,
+with and without 'coalesce'.
+
+    $ python bench_coalesce.py [-t THREADS] [-n SEARCHES]
+"""
+import os
+import glob
+import time
+import shutil
+import argparse
+import tempfile
+import threading
+from otama import Otama
+
+BASE_DIR = os.path.abspath(os.path.dirname(__file__))
+IMAGES = sorted(glob.glob(os.path.join(BASE_DIR, 'image/*.jpg')))
+
+
+def run(config, nthreads, number):
+    db = Otama(config)
+    db.pull()
+    start = time.time()
+
+    def worker(i):
+        for j in range(number):
+            db.search(10, IMAGES[(i + j) % len(IMAGES)])
+
+    threads = [threading.Thread(target=worker, args=(i,))
+               for i in range(nthreads)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.time() - start
+    db.close()
+    return nthreads * number / elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-t', '--threads', type=int, default=16)
+    parser.add_argument('-n', '--number', type=int, default=50)
+    args = parser.parse_args()
+
+    data_dir = tempfile.mkdtemp()
+    config = {
+        'namespace': 'bench',
+        'driver': {'name': 'color', 'data_dir': data_dir},
+        'database': {'driver': 'sqlite3',
+                     'name': os.path.join(data_dir, 'bench.db')}}
+    try:
+        db = Otama(config)
+        db.create_database()
+        for filename in IMAGES:
+            db.insert(filename)
+        db.close()
+
+        for coalesce in (0, 1):
+            qps = run(dict(config, coalesce=coalesce), args.threads, args.number)
+            print("coalesce=%d %8.1f searches/s" % (coalesce, qps))
+    finally:
+        shutil.rmtree(data_dir)
+
+
+if __name__ == '__main__':
+    main()
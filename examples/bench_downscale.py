@@ -0,0 +1,82 @@
+"""latency, peak RSS and similarity drift of decode-time downscaling.
+
+every JPEG is run through feature_raw() at full resolution and with
+max_side, each in a fresh process so peak RSS is comparable. then the
+two features of each image are compared; a similarity below the
+tolerance fails the run.
+
+    $ python bench_downscale.py [-s MAX_SIDE] [-t TOLERANCE] [image ...]
+"""
+import os
+import sys
+import glob
+import json
+import time
+import argparse
+import resource
+import subprocess
+from otama import Otama
+
+BASE_DIR = os.path.abspath(os.path.dirname(__file__))
+CONFIG = {'driver': {'name': 'vlad_nodb'}}
+
+
+def child(max_side, files, repeat):
+    db = Otama(CONFIG)
+    times = []
+    for filename in files:
+        start = time.time()
+        for _ in range(repeat):
+            db.feature_raw({'file': filename}, max_side=max_side).dispose()
+        times.append((time.time() - start) / repeat)
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    print(json.dumps({'times': times, 'rss_kb': rss}))
+
+
+def run(max_side, files, repeat):
+    out = subprocess.check_output(
+        [sys.executable, __file__, '--child', str(max_side),
+         '-r', str(repeat)] + files)
+    return json.loads(out.decode())
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-s', '--max-side', type=int, default=512)
+    parser.add_argument('-t', '--tolerance', type=float, default=0.9)
+    parser.add_argument('-r', '--repeat', type=int, default=5)
+    parser.add_argument('--child', type=int, default=None,
+                        help=argparse.SUPPRESS)
+    parser.add_argument('images', nargs='*')
+    args = parser.parse_args()
+    files = args.images or sorted(glob.glob(os.path.join(BASE_DIR, 'image/*.jpg')))
+
+    if args.child is not None:
+        return child(args.child, files, args.repeat)
+
+    full = run(0, files, args.repeat)
+    scaled = run(args.max_side, files, args.repeat)
+
+    db = Otama(CONFIG)
+    failed = 0
+    print("%-28s %10s %10s %8s" % ("image", "full ms", "scaled ms", "sim"))
+    for i, filename in enumerate(files):
+        fv_full = db.feature_raw({'file': filename}, max_side=0)
+        fv_scaled = db.feature_raw({'file': filename}, max_side=args.max_side)
+        sim = db.similarity({'raw': fv_full}, {'raw': fv_scaled})
+        fv_full.dispose()
+        fv_scaled.dispose()
+        failed += sim < args.tolerance
+        print("%-28s %10.2f %10.2f %8.3f%s" % (
+            os.path.basename(filename)[:28], full['times'][i] * 1e3,
+            scaled['times'][i] * 1e3, sim,
+            "" if sim >= args.tolerance else "  < %.3f" % args.tolerance))
+    print("peak RSS: full %d KiB, max_side=%d %d KiB" % (
+        full['rss_kb'], args.max_side, scaled['rss_kb']))
+    db.close()
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,7 +1,42 @@
-import sys
+import json
+import logging
 
-if int(sys.version[0]) >= 3:
-    from otama.otama import Otama, __libotama_version__
-else:
-    from otama import Otama, __libotama_version__
+from otama.otama import Otama, ShardedOtama, OtamaError, __libotama_version__
+from otama.otama import (LOG_LEVEL_DEBUG, LOG_LEVEL_NOTICE, LOG_LEVEL_ERROR,
+                         LOG_LEVEL_QUIET, set_log_level, get_log_level,
+                         set_log_sink, flush_log, trace_start, trace_stop)
+from otama.daemon import OtamaClient
 from ._version import __version__
+
+logger = logging.getLogger(__name__)
+
+_LOGGING_LEVELS = {
+    LOG_LEVEL_DEBUG: logging.DEBUG,
+    LOG_LEVEL_NOTICE: logging.INFO,
+    LOG_LEVEL_ERROR: logging.ERROR,
+}
+
+
+def log_to_logging(records):
+    """default log sink: forward native log records to the otama logger"""
+    for level, created, message in records:
+        level = _LOGGING_LEVELS.get(level, logging.ERROR)
+        if not logger.isEnabledFor(level):
+            continue
+        record = logger.makeRecord(logger.name, level, '(otama)', 0,
+                                   message, None, None)
+        record.created = created
+        record.msecs = (created - int(created)) * 1000
+        logger.handle(record)
+
+
+def trace_export(path, events=None):
+    """write spans (trace_stop() when omitted) as Chrome trace JSON,
+    viewable in chrome://tracing or Perfetto"""
+    if events is None:
+        events = trace_stop()
+    with open(path, 'w') as f:
+        json.dump({'traceEvents': events, 'displayTimeUnit': 'ms'}, f)
+
+
+set_log_sink(log_to_logging)
@@ -0,0 +1,340 @@
+"""one Otama per host, shared over a Unix-domain socket.
+
+the daemon opens a namespace once, keeps it pulled and answers search,
+insert, similarity, exists, remove and pull for any number of local
+processes. OtamaClient speaks the same methods as Otama.
+
+    $ python -m otama.daemon -s /run/otama.sock [-r REFRESH] example.conf
+
+protocol: every frame is a 4 byte big-endian length and one value in
+the encoding below. a request frame is a list of calls [op, arg, ...],
+the reply frame a list of [True, result] or [False, error, message],
+one per call and in order, so a batch costs one round trip.
+"""
+import os
+import sys
+import stat
+import errno
+import socket
+import struct
+import argparse
+import threading
+import socketserver
+
+from otama.otama import Otama, OtamaError
+
+OP_SEARCH = 1
+OP_INSERT = 2
+OP_SIMILARITY = 3
+OP_EXISTS = 4
+OP_REMOVE = 5
+OP_PULL = 6
+
+MAX_FRAME = 64 * 1024 * 1024
+MAX_DEPTH = 32
+
+_LEN = struct.Struct('>I')
+_INT = struct.Struct('>q')
+_FLOAT = struct.Struct('>d')
+_ERRORS = dict((e.__name__, e) for e in (
+    TypeError, ValueError, KeyError, IndexError, OverflowError,
+    MemoryError, BufferError, OSError, FileNotFoundError, PermissionError,
+    IsADirectoryError, NotADirectoryError, TimeoutError, OtamaError))
+
+
+def _encode(value, out):
+    if value is None:
+        out.append(b'N')
+    elif value is True or value is False:
+        out.append(b'T' if value else b'F')
+    elif isinstance(value, int):
+        out.append(b'i' + _INT.pack(value))
+    elif isinstance(value, float):
+        out.append(b'f' + _FLOAT.pack(value))
+    elif isinstance(value, str):
+        value = value.encode('utf-8')
+        out.append(b's' + _LEN.pack(len(value)) + value)
+    elif isinstance(value, (bytes, bytearray)):
+        out.append(b'b' + _LEN.pack(len(value)) + bytes(value))
+    elif isinstance(value, (list, tuple)):
+        out.append(b'l' + _LEN.pack(len(value)))
+        for item in value:
+            _encode(item, out)
+    elif isinstance(value, dict):
+        out.append(b'd' + _LEN.pack(len(value)))
+        for k, v in value.items():
+            _encode(k, out)
+            _encode(v, out)
+    else:
+        raise TypeError("cannot send %s to otama daemon" % type(value).__name__)
+
+
+def _decode(buf, pos, depth=0):
+    if depth > MAX_DEPTH:
+        raise ValueError("frame nested deeper than %d" % MAX_DEPTH)
+    tag = buf[pos:pos + 1]
+    pos += 1
+    if tag == b'N':
+        return None, pos
+    if tag in (b'T', b'F'):
+        return tag == b'T', pos
+    if tag == b'i':
+        return _INT.unpack_from(buf, pos)[0], pos + 8
+    if tag == b'f':
+        return _FLOAT.unpack_from(buf, pos)[0], pos + 8
+    n = _LEN.unpack_from(buf, pos)[0]
+    pos += 4
+    if tag == b's':
+        return buf[pos:pos + n].decode('utf-8'), pos + n
+    if tag == b'b':
+        return bytes(buf[pos:pos + n]), pos + n
+    if tag == b'l':
+        items = []
+        for _ in range(n):
+            item, pos = _decode(buf, pos, depth + 1)
+            items.append(item)
+        return items, pos
+    if tag == b'd':
+        items = {}
+        for _ in range(n):
+            k, pos = _decode(buf, pos, depth + 1)
+            items[k], pos = _decode(buf, pos, depth + 1)
+        return items, pos
+    raise ValueError("bad frame")
+
+
+def send_frame(sock, value):
+    out = []
+    _encode(value, out)
+    payload = b''.join(out)
+    sock.sendall(_LEN.pack(len(payload)) + payload)
+
+
+def recv_frame(sock, max_size=MAX_FRAME):
+    """@return the decoded value, or None when the peer has closed"""
+    head = _recv_exactly(sock, 4)
+    if head is None:
+        return None
+    size = _LEN.unpack(head)[0]
+    if size > max_size:
+        raise ValueError("frame of %d bytes exceeds %d" % (size, max_size))
+    payload = _recv_exactly(sock, size)
+    if payload is None:
+        return None
+    return _decode(payload, 0)[0]
+
+
+def _recv_exactly(sock, n):
+    buf = bytearray(n)
+    view = memoryview(buf)
+    pos = 0
+    while pos < n:
+        got = sock.recv_into(view[pos:])
+        if not got:
+            return None
+        pos += got
+    return buf
+
+
+class _Handler(socketserver.BaseRequestHandler):
+
+    def handle(self):
+        while True:
+            try:
+                calls = recv_frame(self.request)
+                if calls is None:
+                    return
+                if not isinstance(calls, list):
+                    raise ValueError("bad frame")
+                replies = [self.server.call(c) for c in calls]
+            except Exception:
+                return      # oversized or garbled: drop the client
+            send_frame(self.request, replies)
+
+
+def _remove_stale_socket(path):
+    """unlink a socket left by a daemon that died; refuse to take over
+    one that is live or a path that is not a socket"""
+    try:
+        if not stat.S_ISSOCK(os.lstat(path).st_mode):
+            raise OSError(errno.EEXIST, "%s: exists and is not a socket" % path)
+    except FileNotFoundError:
+        return
+    probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        probe.connect(path)
+    except FileNotFoundError:
+        return
+    except ConnectionRefusedError:
+        os.unlink(path)
+        return
+    else:
+        raise OSError(errno.EADDRINUSE, "%s: an otama daemon is running" % path)
+    finally:
+        probe.close()
+
+
+class OtamaServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    """serve one Otama handle; each connection gets a thread, and the
+    handle's own locks let their searches run side by side"""
+    daemon_threads = True
+
+    def __init__(self, path, config, refresh=None):
+        _remove_stale_socket(path)
+        self.db = Otama(config)
+        self.db.pull()
+        self._stop = threading.Event()
+        self._refresher = None
+        socketserver.UnixStreamServer.__init__(self, path, _Handler)
+        if refresh:
+            self._refresher = threading.Thread(target=self._refresh,
+                                               args=(refresh,), daemon=True)
+            self._refresher.start()
+
+    def server_bind(self):
+        socketserver.UnixStreamServer.server_bind(self)
+        os.chmod(self.server_address, 0o600)
+
+    def _refresh(self, interval):
+        while not self._stop.wait(interval):
+            try:
+                self.db.pull()
+            except OtamaError:
+                pass
+
+    def call(self, call):
+        db = self.db
+        try:
+            op, args = call[0], call[1:]
+            if op == OP_SEARCH:
+                result = db.search(args[0], args[1], where=args[2])
+            elif op == OP_INSERT:
+                result = db.insert(args[0], attrs=args[1])
+            elif op == OP_SIMILARITY:
+                result = db.similarity(args[0], args[1])
+            elif op == OP_EXISTS:
+                result = db.exists(args[0])
+            elif op == OP_REMOVE:
+                result = db.remove(args[0])
+            elif op == OP_PULL:
+                result = db.pull()
+            else:
+                raise ValueError("unknown op %r" % (op,))
+        except Exception as e:
+            return [False, type(e).__name__, str(e)]
+        return [True, result]
+
+    def server_close(self):
+        self._stop.set()
+        socketserver.UnixStreamServer.server_close(self)
+        if os.path.exists(self.server_address):
+            os.unlink(self.server_address)
+        self.db.close()
+
+
+class OtamaClient(object):
+    """Otama-compatible client of an otama daemon.
+
+    file names are opened by the daemon, so they must be readable from
+    it; OtamaFeatureRaw queries cannot be sent.
+    """
+
+    def __init__(self, path):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.connect(path)
+        self._lock = threading.Lock()
+        self._local = threading.local()     # the calling thread's batch
+
+    def _call(self, *call):
+        batch = getattr(self._local, 'batch', None)
+        if batch is not None:
+            batch.append(call)
+            return None
+        return self._send([call])[0]
+
+    def _send(self, calls):
+        with self._lock:
+            send_frame(self._sock, calls)
+            replies = recv_frame(self._sock)
+        if replies is None:
+            raise OtamaError("otama daemon closed the connection")
+        results = []
+        for reply in replies:
+            if not reply[0]:
+                raise _ERRORS.get(reply[1], OtamaError)(reply[2])
+            results.append(reply[1])
+        return results
+
+    def batch(self):
+        """collect the calls this thread makes inside the with block and
+        send them as one frame; the results are in the list it yields,
+        after the block. other threads' calls go out as usual"""
+        return _Batch(self)
+
+    def search(self, num, data, where=None):
+        result = self._call(OP_SEARCH, num, data, where)
+        return None if result is None else tuple(result)
+
+    def insert(self, data, attrs=None):
+        return self._call(OP_INSERT, data, attrs)
+
+    def similarity(self, data1, data2):
+        return self._call(OP_SIMILARITY, data1, data2)
+
+    def exists(self, id):
+        return self._call(OP_EXISTS, id)
+
+    def remove(self, id):
+        return self._call(OP_REMOVE, id)
+
+    def pull(self):
+        return self._call(OP_PULL)
+
+    def close(self):
+        self._sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+
+class _Batch(list):
+
+    def __init__(self, client):
+        list.__init__(self)
+        self._client = client
+        self._calls = []
+
+    def __enter__(self):
+        self._client._local.batch = self._calls
+        return self
+
+    def __exit__(self, exc_type, *exc):
+        self._client._local.batch = None
+        if exc_type is None and self._calls:
+            for call, result in zip(self._calls, self._client._send(self._calls)):
+                self.append(tuple(result) if call[0] == OP_SEARCH else result)
+
+
+def main():
+    parser = argparse.ArgumentParser(prog='python -m otama.daemon')
+    parser.add_argument('-s', '--socket', required=True)
+    parser.add_argument('-r', '--refresh', type=float, default=None,
+                        help="pull() every REFRESH seconds")
+    parser.add_argument('config')
+    args = parser.parse_args()
+
+    server = OtamaServer(args.socket, args.config, refresh=args.refresh)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,47 +1,471 @@
 #include "Python.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <jpeglib.h>
 
 #include "structmember.h"
 #include "otama.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-#if PY_MAJOR_VERSION >= 3
-#define PY3
-#define PyString_Check PyBytes_Check
-#define PyString_GET_SIZE PyUnicode_GET_SIZE
-#define PyString_FromString PyUnicode_FromString
-#define PyString_AsString PyBytes_AsString
-#define OTAMAPY_INIT_ERROR return NULL
-#else
-#define OTAMAPY_INIT_ERROR return
+#if PY_VERSION_HEX < 0x03090000
+#error "otamapy requires Python 3.9 or later"
 #endif
-#ifndef Py_TYPE
-    #define Py_TYPE(ob) (((PyObject*)(ob))->ob_type)
+
+#if PY_VERSION_HEX < 0x030D0000
+/* 3.13 locks a container while iterating it on free-threaded builds */
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
 #endif
 
-static PyObject *PyExc_OtamaError;
-static PyTypeObject OtamaObjectType;
-static PyTypeObject OtamaFeatureRawObjectType;
-static void pyobj2variant(PyObject *object, otama_variant_t *var);
+/*
+ * run a libotama call on self->otama without the GIL.
+ * the handle lock keeps calls on one handle serialized and close() out.
+ * callers otamapy_log_flush() once they hold no lock, since the sink is
+ * Python code that may come back into otamapy.
+ */
+#define OTAMAPY_CALL(self, ret, call)                                   \
+    Py_BEGIN_ALLOW_THREADS                                              \
+    pthread_mutex_lock(&(self)->lock);                                  \
+    ret = (self)->otama ? (call) : OTAMA_STATUS_INVALID_ARGUMENTS;      \
+    pthread_mutex_unlock(&(self)->lock);                                \
+    Py_END_ALLOW_THREADS
+
+/* OTAMAPY_CALL() for a call that writes, held off by index rebuilds */
+#define OTAMAPY_WRITE_CALL(self, ret, call)                             \
+    Py_BEGIN_ALLOW_THREADS                                              \
+    otamapy_write_lock(self);                                           \
+    ret = (self)->otama ? (call) : OTAMA_STATUS_INVALID_ARGUMENTS;      \
+    pthread_mutex_unlock(&(self)->lock);                                \
+    Py_END_ALLOW_THREADS
+
+/* OTAMAPY_CALL() recorded as a trace span */
+#define OTAMAPY_TRACED_CALL(self, ret, name, call)                      \
+    Py_BEGIN_ALLOW_THREADS                                              \
+    long long _t0;                                                      \
+    pthread_mutex_lock(&(self)->lock);                                  \
+    _t0 = trace_begin();                                                \
+    ret = (self)->otama ? (call) : OTAMA_STATUS_INVALID_ARGUMENTS;      \
+    trace_end(name, _t0);                                               \
+    pthread_mutex_unlock(&(self)->lock);                                \
+    Py_END_ALLOW_THREADS
+
+/*
+ * log records of otamapy's native side (background jobs, shard workers,
+ * opens), written from any thread without the GIL and handed to the
+ * log sink in batches on the next call that holds the GIL anyway.
+ * libotama has no log callback; its own lines still go to stderr.
+ */
+#define OTAMAPY_LOG_RING 256
+#define OTAMAPY_LOG_LINE 256
+
+typedef struct {
+    int level;
+    double time;
+    char message[OTAMAPY_LOG_LINE];
+} log_record_t;
+
+typedef struct {
+    pthread_mutex_t lock;       /* also guards the sink */
+    int ready;                  /* lock initialized */
+    volatile int pending;       /* read without the lock as a hint */
+    int level;
+    unsigned long head;
+    unsigned long tail;
+    unsigned long dropped;
+    log_record_t records[OTAMAPY_LOG_RING];
+} log_ring_t;
+
+/* per-module state, one per (sub)interpreter */
+typedef struct {
+    PyObject *error;
+    PyTypeObject *otama_type;
+    PyTypeObject *feature_raw_type;
+    PyTypeObject *sharded_type;
+    PyTypeObject *index_job_type;
+    PyTypeObject *feature_set_type;
+    PyObject *log_sink;         /* called with a list of (level, time, message) */
+    log_ring_t log;
+} otamapy_state;
+
+/* libotama's own level is per process; set_log_level() was called */
+static pthread_mutex_t log_level_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_level_set;
+
+/* trace spans, exported as Chrome trace events */
+typedef struct {
+    const char *name;           /* a string literal */
+    long long start;            /* ns, CLOCK_MONOTONIC */
+    long long duration;
+    long tid;
+} trace_event_t;
+
+static struct {
+    pthread_mutex_t lock;
+    volatile int enabled;
+    size_t capacity;
+    size_t count;
+    size_t dropped;
+    trace_event_t *events;
+} trace = {PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * raw features are freed by dispose() while another thread may still be
+ * scoring against them; whoever turns an OtamaFeatureRaw into a variant
+ * holds this for reading until libotama is done with it.
+ */
+static pthread_rwlock_t raw_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * ShardedOtama searches with a timeout wait here for their shard jobs,
+ * and cancel() wakes them; guards the bookkeeping of detached jobs.
+ */
+static pthread_mutex_t shard_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shard_wait_cond = PTHREAD_COND_INITIALIZER;
+
+static struct PyModuleDef OtamaModuleDef;
+static int pyobj2variant(otamapy_state *st, PyObject *object, otama_variant_t *var);
+
+#define OTAMAPY_ATTR_UNSET LONG_MIN
+
+/*
+ * scans a filtered search may run. the first fetches num * 4, each next
+ * one sizes itself by the hit rate seen so far (x16 after no hits), so
+ * the last covers num * 1024 results even when the others found none.
+ */
+#define OTAMAPY_WHERE_PASSES 3
+#define OTAMAPY_WHERE_OVERFETCH 4
+#define OTAMAPY_WHERE_GROWTH 16
+
+typedef struct {
+    char *name;
+    long *values;               /* one per row, OTAMAPY_ATTR_UNSET when absent */
+} attr_column_t;
+
+typedef struct {
+    long nrows;
+    long capacity;
+    otama_id_t *ids;            /* row -> id */
+    long *slots;                /* open addressing id -> row + 1, 0 = empty */
+    long nslots;
+    int ncolumns;
+    attr_column_t *columns;
+    FILE *fp;                   /* opts.attrs_file, opened for appending */
+} attr_table_t;
+
+typedef struct {
+    int column;
+    long value;
+} attr_cond_t;
+
+typedef struct {
+    char *name;
+    long value;
+} attr_kv_t;
+
+/* config keys consumed by otamapy itself, never passed to libotama */
+typedef struct {
+    int threads;                /* scan threads per search, 0 = library default */
+    int max_side;               /* JPEG decode target, 0 = full resolution */
+    int coalesce;               /* share scans of identical concurrent searches */
+    char dedup_file[PATH_MAX];  /* where dedup inserts are recorded, "" = nowhere */
+    char attrs_file[PATH_MAX];  /* where attribute changes are recorded, "" = nowhere */
+} open_opts_t;
+
+/* content hash -> id of the files inserted with dedup */
+typedef struct {
+    unsigned long long hash;    /* 0 = empty slot */
+    int max_side;               /* downscaled inserts get other ids */
+    otama_id_t id;
+} dedup_entry_t;
+
+typedef struct {
+    long count;
+    long nslots;
+    dedup_entry_t *slots;
+    FILE *fp;                   /* opts.dedup_file, opened for appending */
+    unsigned long hits;
+    unsigned long misses;
+} dedup_table_t;
+
+/*
+ * a search scan other callers may wait on, see OtamaObject_search().
+ * refs and the list links are guarded by the owner's flights_lock (the
+ * module runs without the GIL on free-threaded builds), done by lock.
+ * the key is kept in C so the list is searched without Python calls.
+ */
+typedef struct search_flight {
+    struct search_flight *next;
+    char *path;                 /* the key: file, num and max_side */
+    Py_ssize_t path_len;
+    int num;
+    int max_side;
+    PyObject *result;           /* NULL if the scan failed */
+    int refs;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} search_flight_t;
 
 /* Otama Object */
 typedef struct {
     PyObject_HEAD
+    otamapy_state *state;       /* kept alive by the type, which holds the module */
     otama_t *otama;
+    open_opts_t opts;
+    pthread_mutex_t lock;       /* held around libotama calls made without the GIL */
+    pthread_mutex_t attrs_lock; /* never held across Python API calls */
+    attr_table_t attrs;
+    dedup_table_t dedup;        /* guarded by attrs_lock too */
+    PyObject *config;           /* kept to open a second handle for background jobs */
+    search_flight_t *flights;   /* searches in progress, with opts.coalesce */
+    pthread_mutex_t flights_lock; /* never held across Python API calls */
+    int jobs;                   /* background index jobs alive, under lock */
+    int rebuilding;             /* of which not swapped in yet; writes wait */
+    pthread_cond_t jobs_cond;   /* signalled with lock when either drops */
 } OtamaObject;
 
+/*
+ * lock self->lock for a write. a background vacuum_index/drop_index
+ * rebuilds from the database and the owner then pulls the result, so a
+ * write landing in between would be lost; writes wait for the swap.
+ */
+static void
+otamapy_write_lock(OtamaObject *self)
+{
+    pthread_mutex_lock(&self->lock);
+    while (self->rebuilding) {
+        pthread_cond_wait(&self->jobs_cond, &self->lock);
+    }
+}
+
 typedef struct {
     OtamaObject base;
     otama_feature_raw_t *raw;
 } OtamaFeatureRawObject;
 
+/*
+ * OtamaFeatureSet Object: raw features of one handle, kept in a single
+ * array and scored together. guarded by owner->lock, not raw_lock,
+ * since the features never leave the set.
+ */
+typedef struct {
+    PyObject_HEAD
+    OtamaObject *owner;
+    Py_ssize_t count;
+    Py_ssize_t capacity;
+    otama_feature_raw_t **raws;
+} OtamaFeatureSetObject;
+
+/* ShardedOtama Object */
+typedef struct {
+    PyObject_HEAD
+    otamapy_state *state;
+    int nshards;
+    otama_t **shards;
+    open_opts_t *opts;
+    pthread_mutex_t *locks;     /* one per shard, held around every libotama call */
+    int running;                /* detached shard jobs, under shard_wait_lock */
+    unsigned long cancel_seq;   /* bumped by cancel(), under shard_wait_lock */
+} OtamaShardedObject;
+
+
+/*
+ * take a mutex that is never held across Python API calls, without
+ * blocking other threads on the GIL (or stop-the-world GC) meanwhile.
+ */
+static void
+otamapy_lock(pthread_mutex_t *mutex)
+{
+    if (pthread_mutex_trylock(mutex) != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(mutex);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+/*
+ * a strong reference to dict[key] in *item, NULL when missing. another
+ * thread may drop a borrowed one from the dict while we run without
+ * the GIL on free-threaded builds.
+ * @return 1 found, 0 missing, -1 with an exception set
+ */
+static int
+otamapy_dict_get(PyObject *dict, const char *key, PyObject **item)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+    return PyDict_GetItemStringRef(dict, key, item);
+#else
+    *item = PyDict_GetItemString(dict, key);
+    Py_XINCREF(*item);
+    return *item != NULL;
+#endif
+}
+
+/*
+ * PySequence_Fast() that never lends the items of a list, which another
+ * thread may change while a caller works through it without the GIL:
+ * a list is copied into a tuple holding its own references.
+ * @return new reference or NULL with an exception set
+ */
+static PyObject *
+otamapy_sequence(PyObject *obj, const char *message)
+{
+    PyObject *seq = PySequence_Fast(obj, message), *tuple;
+
+    if (!seq || PyTuple_CheckExact(seq)) {
+        return seq;
+    }
+    tuple = PyList_AsTuple(seq);
+    Py_DECREF(seq);
+
+    return tuple;
+}
+
+/*
+ * unpack METH_FASTCALL|METH_KEYWORDS arguments into out[] in kwlist
+ * order. the first min are required; omitted ones are left untouched,
+ * so callers preset their defaults.
+ * @return 0 or -1 with an exception set
+ */
+static int
+otamapy_unpack(PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+               const char *const *kwlist, int min, PyObject **out)
+{
+    Py_ssize_t nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0, i;
+    unsigned int seen = 0;
+    int n = 0, k;
+
+    while (kwlist[n]) {
+        ++n;
+    }
+    if (nargs > n) {
+        goto error;
+    }
+    for (i = 0; i < nargs; ++i) {
+        out[i] = args[i];
+        seen |= 1U << i;
+    }
+    for (i = 0; i < nkw; ++i) {
+        PyObject *key = PyTuple_GET_ITEM(kwnames, i);
+        for (k = 0; k < n; ++k) {
+            if (PyUnicode_CompareWithASCIIString(key, kwlist[k]) == 0) {
+                break;
+            }
+        }
+        if (k == n || (seen & (1U << k))) {
+            goto error;
+        }
+        out[k] = args[nargs + i];
+        seen |= 1U << k;
+    }
+    for (k = 0; k < min; ++k) {
+        if (!(seen & (1U << k))) {
+            goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    PyErr_SetString(PyExc_TypeError, "argument error");
+    return -1;
+}
+
+/* PyArg_Parse "i" for an unpacked argument */
+static int
+otamapy_arg_int(PyObject *obj, int *value)
+{
+    long v = PyLong_AsLong(obj);
+
+    if ((v == -1 && PyErr_Occurred()) || v < INT_MIN || v > INT_MAX) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_TypeError, "argument error");
+        return -1;
+    }
+    *value = (int)v;
+
+    return 0;
+}
+
+/* otamapy_lock() for reading raw_lock */
+static void
+otamapy_raw_rdlock(void)
+{
+    if (pthread_rwlock_tryrdlock(&raw_lock) != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_rwlock_rdlock(&raw_lock);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+/* otamapy_lock() for writing raw_lock */
+static void
+otamapy_raw_wrlock(void)
+{
+    if (pthread_rwlock_trywrlock(&raw_lock) != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_rwlock_wrlock(&raw_lock);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+/* module state of the otama module a (possibly derived) type belongs to */
+static otamapy_state *
+otamapy_get_state(PyTypeObject *type)
+{
+    PyObject *module;
+
+#if PY_VERSION_HEX >= 0x030B0000
+    module = PyType_GetModuleByDef(type, &OtamaModuleDef);
+#else
+    PyObject *mro = type->tp_mro;
+    Py_ssize_t i;
+
+    module = NULL;
+    for (i = 0; mro && i < PyTuple_GET_SIZE(mro) && !module; ++i) {
+        PyTypeObject *base = (PyTypeObject *)PyTuple_GET_ITEM(mro, i);
+        if (PyType_HasFeature(base, Py_TPFLAGS_HEAPTYPE)) {
+            module = PyType_GetModule(base);
+            if (!module) {
+                PyErr_Clear();
+            }
+            else if (PyModule_GetDef(module) != &OtamaModuleDef) {
+                module = NULL;
+            }
+        }
+    }
+    if (!module) {
+        PyErr_SetString(PyExc_TypeError, "not an otama type");
+    }
+#endif
+    if (!module) {
+        return NULL;
+    }
+
+    return (otamapy_state *)PyModule_GetState(module);
+}
 
 static void
-otamapy_raise(otama_status_t ret)
+otamapy_raise(otamapy_state *st, otama_status_t ret)
 {
     switch (ret) {
         case OTAMA_STATUS_OK:
@@ -51,14 +475,158 @@ otamapy_raise(otama_status_t ret)
         case OTAMA_STATUS_ASSERTION_FAILURE:
         case OTAMA_STATUS_SYSERROR:
         case OTAMA_STATUS_NOT_IMPLEMENTED:
-            PyErr_SetString(PyExc_OtamaError, otama_status_message(ret));
+            PyErr_SetString(st->error, otama_status_message(ret));
             break;
         default:
-            PyErr_SetString(PyExc_OtamaError, "Unknown Error");
+            PyErr_SetString(st->error, "Unknown Error");
             break;
     }
 }
 
+static long
+otamapy_gettid(void)
+{
+#ifdef __linux__
+    return (long)syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
+static void
+otamapy_log(otamapy_state *st, int level, const char *fmt, ...)
+{
+    log_ring_t *ring = &st->log;
+    struct timeval tv;
+    log_record_t *rec;
+    va_list ap;
+
+    if (level < ring->level) {
+        return;
+    }
+    gettimeofday(&tv, NULL);
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->head - ring->tail == OTAMAPY_LOG_RING) {
+        ring->tail++;           /* overwrite the oldest */
+        ring->dropped++;
+    }
+    rec = &ring->records[ring->head++ % OTAMAPY_LOG_RING];
+    rec->level = level;
+    rec->time = tv.tv_sec + tv.tv_usec / 1e6;
+    va_start(ap, fmt);
+    vsnprintf(rec->message, OTAMAPY_LOG_LINE, fmt, ap);
+    va_end(ap);
+    ring->pending = 1;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * hand pending records to the log sink. needs the GIL and must not be
+ * called with any otamapy lock held; errors raised by the sink are
+ * reported as unraisable, never to the caller.
+ */
+static void
+otamapy_log_flush(otamapy_state *st)
+{
+    log_ring_t *ring = &st->log;
+    log_record_t *records;
+    unsigned long n, dropped, i;
+    PyObject *sink, *batch, *type, *value, *traceback, *ret;
+
+    if (!ring->pending) {
+        return;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    n = ring->head - ring->tail;
+    if (!st->log_sink
+        || !(records = malloc(sizeof(log_record_t) * (n ? n : 1)))) {
+        pthread_mutex_unlock(&ring->lock);
+        return;
+    }
+    for (i = 0; i < n; ++i) {
+        records[i] = ring->records[(ring->tail + i) % OTAMAPY_LOG_RING];
+    }
+    dropped = ring->dropped;
+    ring->tail = ring->head;
+    ring->dropped = 0;
+    ring->pending = 0;
+    sink = st->log_sink;
+    Py_INCREF(sink);
+    pthread_mutex_unlock(&ring->lock);
+
+    PyErr_Fetch(&type, &value, &traceback);
+    batch = PyList_New(0);
+    for (i = 0; batch && i < n; ++i) {
+        PyObject *item = Py_BuildValue("(ids)", records[i].level,
+                                       records[i].time, records[i].message);
+        if (!item || PyList_Append(batch, item) < 0) {
+            Py_CLEAR(batch);
+        }
+        Py_XDECREF(item);
+    }
+    if (batch && dropped) {
+        PyObject *item = PyUnicode_FromFormat("%lu log records dropped", dropped);
+        PyObject *rec = item ? Py_BuildValue("(idO)", OTAMA_LOG_LEVEL_ERROR,
+                                             records[0].time, item) : NULL;
+        if (!rec || PyList_Insert(batch, 0, rec) < 0) {
+            Py_CLEAR(batch);
+        }
+        Py_XDECREF(rec);
+        Py_XDECREF(item);
+    }
+    free(records);
+
+    ret = batch ? PyObject_CallOneArg(sink, batch) : NULL;
+    if (!ret) {
+        PyErr_WriteUnraisable(sink);
+    }
+    Py_XDECREF(ret);
+    Py_XDECREF(batch);
+    Py_DECREF(sink);
+    PyErr_Restore(type, value, traceback);
+}
+
+/* @return span start for trace_end(), 0 when not tracing */
+static long long
+trace_begin(void)
+{
+    struct timespec ts;
+
+    if (!trace.enabled) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+trace_end(const char *name, long long start)
+{
+    struct timespec ts;
+    trace_event_t *ev;
+
+    if (!start) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    pthread_mutex_lock(&trace.lock);
+    if (trace.enabled && trace.count < trace.capacity) {
+        ev = &trace.events[trace.count++];
+        ev->name = name;
+        ev->start = start;
+        ev->duration = ts.tv_sec * 1000000000LL + ts.tv_nsec - start;
+        ev->tid = otamapy_gettid();
+    }
+    else {
+        trace.dropped++;
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
 static PyObject *
 variant2pyobj(otama_variant_t *var)
 {
@@ -68,15 +636,14 @@ variant2pyobj(otama_variant_t *var)
         case OTAMA_VARIANT_TYPE_FLOAT:
             return PyFloat_FromDouble(otama_variant_to_float(var));
         case OTAMA_VARIANT_TYPE_STRING:
-            return PyString_FromString(otama_variant_to_string(var));
+            return PyUnicode_FromString(otama_variant_to_string(var));
         case OTAMA_VARIANT_TYPE_ARRAY: {
             long count = otama_variant_array_count(var);
             int i;
             PyObject *tuple = PyTuple_New(count);
             for (i = 0; i < count; ++i) {
                 PyObject *_value = variant2pyobj(otama_variant_array_at(var, i));
-                PyTuple_SetItem(tuple, i, _value);
-                Py_DECREF(_value);
+                PyTuple_SetItem(tuple, i, _value);  // steals _value
             }
             return tuple;
         }
@@ -104,22 +671,52 @@ variant2pyobj(otama_variant_t *var)
     Py_RETURN_NONE;
 }
 
-static void
-pyobj2variant_pair(PyObject *key, PyObject *value, otama_variant_t *var)
+/*
+ * a buffer of encoded image bytes: C-contiguous, one-byte items.
+ * @return 0 with view to PyBuffer_Release(), or -1 with an exception set
+ */
+static int
+otamapy_get_bytes(PyObject *object, Py_buffer *view)
 {
-    const char *key_string;
-#ifdef PY3
-    PyObject *utf8_item;
-    utf8_item = PyUnicode_AsUTF8String(key);
-    key_string = PyBytes_AsString(utf8_item);
-#else
-    key_string = PyString_AsString(key);
-#endif
-    pyobj2variant(value, otama_variant_hash_at(var, key_string));
+    int got = PyObject_GetBuffer(object, view,
+                                 PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) == 0;
+
+    if (!got) {
+        if (!PyErr_ExceptionMatches(PyExc_BufferError)) {
+            return -1;
+        }
+        PyErr_Clear();
+    }
+    if (!got || view->itemsize != 1 || !view->format
+        || !(strcmp(view->format, "B") == 0 || strcmp(view->format, "b") == 0
+             || strcmp(view->format, "c") == 0)) {
+        if (got) {
+            PyBuffer_Release(view);
+        }
+        PyErr_SetString(PyExc_TypeError,
+                        "buffer must be contiguous bytes (format 'B', 'b' or 'c')");
+        return -1;
+    }
+
+    return 0;
 }
 
-static void
-pyobj2variant(PyObject *object, otama_variant_t *var)
+static int
+pyobj2variant_pair(otamapy_state *st, PyObject *key, PyObject *value,
+                   otama_variant_t *var)
+{
+    const char *key_string = PyUnicode_AsUTF8(key);
+
+    if (!key_string) {
+        PyErr_Clear();
+        return 0;
+    }
+    return pyobj2variant(st, value, otama_variant_hash_at(var, key_string));
+}
+
+/* @return 0 or -1 with an exception set */
+static int
+pyobj2variant(otamapy_state *st, PyObject *object, otama_variant_t *var)
 {
     if (PyBool_Check(object)) {
         if (Py_True == object) {
@@ -138,76 +735,117 @@ pyobj2variant(PyObject *object, otama_variant_t *var)
     else if (PyLong_Check(object)) {
         otama_variant_set_int(var, PyLong_AsLong(object));
     }
-    else if (PyString_Check(object)) {
-        if (strlen(PyString_AsString(object)) == PyString_GET_SIZE(object)) {
-            otama_variant_set_string(var, PyString_AsString(object));
+    else if (PyBytes_Check(object)) {
+        if (strlen(PyBytes_AS_STRING(object)) == (size_t)PyBytes_GET_SIZE(object)) {
+            otama_variant_set_string(var, PyBytes_AS_STRING(object));
         }
         else {
-            otama_variant_set_binary(var, PyString_AsString(object),
-                                     PyString_GET_SIZE(object));
+            otama_variant_set_binary(var, PyBytes_AS_STRING(object),
+                                     PyBytes_GET_SIZE(object));
         }
     }
     else if (PyUnicode_Check(object)) {
-#ifdef PY3
-        PyObject *utf8_item;
-        utf8_item = PyUnicode_AsUTF8String(object);
-        if (!utf8_item) {
-            PyErr_SetString(PyExc_OtamaError, "don't gen utf8 item");
-            return (void)NULL;
+        Py_ssize_t size;
+        const char *_tmp = PyUnicode_AsUTF8AndSize(object, &size);
+        if (!_tmp) {
+            PyErr_SetString(st->error, "don't gen utf8 item");
+            return -1;
         }
 
-        if (strlen(PyBytes_AsString(utf8_item)) == PyUnicode_GET_SIZE(object)) {
-            const char *_tmp = PyBytes_AsString(utf8_item);
+        if (strlen(_tmp) == (size_t)size) {
             otama_variant_set_string(var, _tmp);
         }
         else {
-            // TODO: not need?
-            otama_variant_set_binary(var, PyBytes_AsString(object),
-                                     PyString_GET_SIZE(object));
+            otama_variant_set_binary(var, _tmp, size);
         }
-
-        Py_XDECREF(utf8_item);
-#else
-        otama_variant_set_string(var, PyBytes_AsString(object));
-#endif
     }
     else if (PyTuple_Check(object)) {
         int len = PyTuple_Size(object), i;
         otama_variant_set_array(var);
         for (i = 0; i < len; ++i) {
             PyObject *elm = PyTuple_GetItem(object, i);
-            pyobj2variant(elm, otama_variant_array_at(var, i));
+            if (pyobj2variant(st, elm, otama_variant_array_at(var, i)) < 0) {
+                return -1;
+            }
         }
     }
     else if (PyList_Check(object)) {
-        int len = PyList_Size(object), i;
+        int i, err = 0;
         otama_variant_set_array(var);
-        for (i = 0; i < len; ++i) {
-            PyObject *elm = PyList_GetItem(object, i);
-            pyobj2variant(elm, otama_variant_array_at(var, i));
+        /* the caller's list, so hold it (and our own references to its
+         * items) while another thread could change it */
+        Py_BEGIN_CRITICAL_SECTION(object);
+        for (i = 0; !err && i < PyList_GET_SIZE(object); ++i) {
+            PyObject *elm = PyList_GET_ITEM(object, i);
+            Py_INCREF(elm);
+            err = pyobj2variant(st, elm, otama_variant_array_at(var, i));
+            Py_DECREF(elm);
+        }
+        Py_END_CRITICAL_SECTION();
+        if (err < 0) {
+            return -1;
         }
     }
     else if (PyDict_Check(object)) {
         otama_variant_set_hash(var);
         PyObject *key, *value;
         Py_ssize_t pos = 0;
-        while (PyDict_Next(object, &pos, &key, &value)) {
+        int err = 0;
+        Py_BEGIN_CRITICAL_SECTION(object);
+        while (!err && PyDict_Next(object, &pos, &key, &value)) {
             PyObject *_size = PyLong_FromSsize_t(pos);
             long i = PyLong_AsLong(_size);
             Py_XDECREF(_size);
             if (i == -1) break;
 
-            pyobj2variant_pair(key, value, var);
+            Py_INCREF(key);
+            Py_INCREF(value);
+            err = pyobj2variant_pair(st, key, value, var);
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
+        Py_END_CRITICAL_SECTION();
+        if (err < 0) {
+            return -1;
+        }
+    }
+    else if (PyObject_CheckBuffer(object)) {
+        /* bytearray, memoryview, array or a NumPy uint8 array of
+         * encoded image data; the variant keeps its own copy */
+        Py_buffer view;
+        if (otamapy_get_bytes(object, &view) < 0) {
+            return -1;
         }
+        otama_variant_set_binary(var, view.buf, view.len);
+        PyBuffer_Release(&view);
     }
     else {
-        if (PyObject_IsInstance(object, (PyObject *)&OtamaFeatureRawObjectType)) {
+        if (PyObject_TypeCheck(object, st->feature_raw_type)) {
             otama_variant_set_pointer(var, ((OtamaFeatureRawObject *)object)->raw);
         }
         else {
             otama_variant_set_null(var);
         }
     }
+
+    return 0;
+}
+
+static PyObject *
+make_result(const otama_result_t *results, long i)
+{
+    otama_variant_t *value = otama_result_value(results, i);
+    char hexid[OTAMA_ID_HEXSTR_LEN];
+
+    otama_id_bin2hexstr(hexid, otama_result_id(results, i));
+    PyObject *_result = variant2pyobj(value);   // return new dict
+    PyObject *_hexid = PyUnicode_FromString(hexid);
+    PyDict_SetItemString(_result, "id", _hexid);
+    // TODO: error handle
+
+    Py_XDECREF(_hexid);
+
+    return _result;
 }
 
 static PyObject *
@@ -219,263 +857,3477 @@ make_results(const otama_result_t *results)
 
     result_tuple = PyTuple_New(num);
     for (i = 0; i < num; ++i) {
-        otama_variant_t *value = otama_result_value(results, i);
-        char hexid[OTAMA_ID_HEXSTR_LEN];
-
-        otama_id_bin2hexstr(hexid, otama_result_id(results, i));
-        PyObject *_result = variant2pyobj(value);   // return new dict
-        PyObject *_hexid = PyString_FromString(hexid);
-        PyDict_SetItemString(_result, "id", _hexid);
-        // TODO: error handle
-
-        PyTuple_SetItem(result_tuple, i, _result);
-
-        Py_XDECREF(_hexid);
+        PyTuple_SetItem(result_tuple, i, make_result(results, i));
     }
 
     return result_tuple;
 }
 
+static float
+result_similarity(const otama_result_t *results, long i)
+{
+    otama_variant_t *value = otama_result_value(results, i);
+    return otama_variant_to_float(otama_variant_hash_at(value, "similarity"));
+}
+
 /*
- * @return PyObject *self or NULL
+ * @return path string of data, or NULL when data is not a string.
+ *         *keep receives a temporary object to release with Py_XDECREF.
  */
-static PyObject *
-setup_config(OtamaObject *self, PyObject *config)
+static const char *
+pyobj2str(PyObject *data, PyObject **keep)
 {
-    otama_status_t ret = OTAMA_STATUS_OK;
-
-    if (config) {
-        if (PyString_Check(config)) {
-            ret = otama_open(&self->otama, PyString_AsString(config));
-        }
-        else if (PyUnicode_Check(config)) {
-            PyObject *utf8_item;
-            utf8_item = PyUnicode_AsUTF8String(config);
-            if (!utf8_item) {
-                PyErr_SetString(PyExc_OtamaError, "don't gen utf8 item");
-                return NULL;
-            }
-            ret = otama_open(&self->otama, PyBytes_AsString(utf8_item));
-            Py_XDECREF(utf8_item);
+    *keep = NULL;
+    if (PyBytes_Check(data)) {
+        return PyBytes_AsString(data);
+    }
+    else if (PyUnicode_Check(data)) {
+        *keep = PyUnicode_AsUTF8String(data);
+        if (!*keep) {
+            return NULL;
         }
-        else if (PyDict_Check(config)) {
-            otama_variant_t *var;
-            otama_variant_pool_t *pool;
+        return PyBytes_AsString(*keep);
+    }
 
-            pool = otama_variant_pool_alloc();
-            var = otama_variant_new(pool);
+    return NULL;
+}
 
-            pyobj2variant(config, var);
-            ret = otama_open_opt(&self->otama, var);
+/* insert-time attributes, kept column by column for search filtering */
 
-            otama_variant_pool_free(&pool);
-        }
-        else {
-            PyErr_SetString(PyExc_TypeError, "not support type.");
-            return NULL;
-        }
+static unsigned long
+attr_hash(const otama_id_t *id)
+{
+    const unsigned char *p = (const unsigned char *)id;
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    for (i = 0; i < sizeof(otama_id_t); ++i) {
+        h ^= p[i];
+        h *= 16777619UL;
+    }
+
+    return h;
+}
+
+/* @return slot of id, or -1 */
+static long
+attr_table_slot(const attr_table_t *t, const otama_id_t *id)
+{
+    unsigned long i;
+
+    if (t->nslots == 0) {
+        return -1;
+    }
+    for (i = attr_hash(id) % t->nslots; t->slots[i]; i = (i + 1) % t->nslots) {
+        long row = t->slots[i] - 1;
+        if (memcmp(&t->ids[row], id, sizeof(otama_id_t)) == 0) {
+            return (long)i;
+        }
+    }
+
+    return -1;
+}
+
+static long
+attr_table_find(const attr_table_t *t, const otama_id_t *id)
+{
+    long i = attr_table_slot(t, id);
+
+    return i < 0 ? -1 : t->slots[i] - 1;
+}
+
+/*
+ * record a change in the attrs file. a record is the id, the name
+ * length, the name and the value back to back in host byte order, or
+ * the id and a length of -1 for a dropped row. the file belongs to one
+ * host, like the dedup file.
+ */
+static void
+attr_log(attr_table_t *t, const otama_id_t *id, const char *name, long value)
+{
+    int len = name ? (int)strlen(name) : -1;
+
+    if (t->fp) {
+        fwrite(id, sizeof(otama_id_t), 1, t->fp);
+        fwrite(&len, sizeof(len), 1, t->fp);
+        if (name) {
+            fwrite(name, 1, len, t->fp);
+            fwrite(&value, sizeof(value), 1, t->fp);
+        }
+        fflush(t->fp);
+    }
+}
+
+/* drop the row of id, if any, moving the last row into its place */
+static void
+attr_table_delete(attr_table_t *t, const otama_id_t *id)
+{
+    long i = attr_table_slot(t, id), j, row, last;
+    int c;
+
+    if (i < 0) {
+        return;
+    }
+    attr_log(t, id, NULL, 0);
+    row = t->slots[i] - 1;
+
+    /* backward-shift the probe chain over the freed slot */
+    t->slots[i] = 0;
+    for (j = (i + 1) % t->nslots; t->slots[j]; j = (j + 1) % t->nslots) {
+        long k = attr_hash(&t->ids[t->slots[j] - 1]) % t->nslots;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        t->slots[i] = t->slots[j];
+        t->slots[j] = 0;
+        i = j;
+    }
+
+    last = --t->nrows;
+    if (row != last) {
+        memcpy(&t->ids[row], &t->ids[last], sizeof(otama_id_t));
+        for (c = 0; c < t->ncolumns; ++c) {
+            t->columns[c].values[row] = t->columns[c].values[last];
+        }
+        t->slots[attr_table_slot(t, &t->ids[row])] = row + 1;
+    }
+}
+
+static int
+attr_table_rehash(attr_table_t *t, long nslots)
+{
+    long *slots = PyMem_Malloc(sizeof(long) * nslots);
+    long row;
+
+    if (!slots) {
+        return -1;
+    }
+    memset(slots, 0, sizeof(long) * nslots);
+    for (row = 0; row < t->nrows; ++row) {
+        unsigned long i = attr_hash(&t->ids[row]) % nslots;
+        while (slots[i]) {
+            i = (i + 1) % nslots;
+        }
+        slots[i] = row + 1;
+    }
+    PyMem_Free(t->slots);
+    t->slots = slots;
+    t->nslots = nslots;
+
+    return 0;
+}
+
+/* @return row of id, appended when missing, or -1 */
+static long
+attr_table_row(attr_table_t *t, const otama_id_t *id)
+{
+    long row = attr_table_find(t, id);
+    unsigned long i;
+    int c;
+
+    if (row >= 0) {
+        return row;
+    }
+    if (t->nrows == t->capacity) {
+        long capacity = t->capacity ? t->capacity * 2 : 64;
+        otama_id_t *ids = PyMem_Realloc(t->ids, sizeof(otama_id_t) * capacity);
+        if (!ids) {
+            return -1;
+        }
+        t->ids = ids;
+        for (c = 0; c < t->ncolumns; ++c) {
+            long *values = PyMem_Realloc(t->columns[c].values, sizeof(long) * capacity);
+            if (!values) {
+                return -1;
+            }
+            t->columns[c].values = values;
+        }
+        t->capacity = capacity;
+    }
+    if ((t->nrows + 1) * 2 > t->nslots
+        && attr_table_rehash(t, t->capacity * 2) < 0) {
+        return -1;
+    }
+
+    row = t->nrows++;
+    memcpy(&t->ids[row], id, sizeof(otama_id_t));
+    for (c = 0; c < t->ncolumns; ++c) {
+        t->columns[c].values[row] = OTAMAPY_ATTR_UNSET;
+    }
+    i = attr_hash(id) % t->nslots;
+    while (t->slots[i]) {
+        i = (i + 1) % t->nslots;
+    }
+    t->slots[i] = row + 1;
+
+    return row;
+}
+
+/* @return column index of name, -1 when missing and not created */
+static int
+attr_table_column(attr_table_t *t, const char *name, int create)
+{
+    attr_column_t *columns;
+    long row;
+    int c;
+
+    for (c = 0; c < t->ncolumns; ++c) {
+        if (strcmp(t->columns[c].name, name) == 0) {
+            return c;
+        }
+    }
+    if (!create) {
+        return -1;
+    }
+
+    columns = PyMem_Realloc(t->columns, sizeof(attr_column_t) * (t->ncolumns + 1));
+    if (!columns) {
+        return -1;
+    }
+    t->columns = columns;
+    c = t->ncolumns;
+    columns[c].name = PyMem_Malloc(strlen(name) + 1);
+    columns[c].values = PyMem_Malloc(sizeof(long) * (t->capacity ? t->capacity : 1));
+    if (!columns[c].name || !columns[c].values) {
+        PyMem_Free(columns[c].name);
+        PyMem_Free(columns[c].values);
+        return -1;
+    }
+    strcpy(columns[c].name, name);
+    for (row = 0; row < t->nrows; ++row) {
+        columns[c].values[row] = OTAMAPY_ATTR_UNSET;
+    }
+    t->ncolumns++;
+
+    return c;
+}
+
+static void
+attr_table_free(attr_table_t *t)
+{
+    int c;
+
+    for (c = 0; c < t->ncolumns; ++c) {
+        PyMem_Free(t->columns[c].name);
+        PyMem_Free(t->columns[c].values);
+    }
+    if (t->fp) {
+        fclose(t->fp);
+    }
+    PyMem_Free(t->columns);
+    PyMem_Free(t->ids);
+    PyMem_Free(t->slots);
+    memset(t, 0, sizeof(attr_table_t));
+}
+
+static void
+attr_kv_free(attr_kv_t *kv, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        PyMem_Free(kv[i].name);
+    }
+    PyMem_Free(kv);
+}
+
+/* copy one attrs item into kv. @return 0 or -1 with an exception set */
+static int
+attr_parse_item(PyObject *key, PyObject *value, attr_kv_t *kv)
+{
+    const char *name;
+    long v;
+
+    if (!PyUnicode_Check(key)) {
+        PyErr_SetString(PyExc_TypeError, "attribute name must be a string");
+        return -1;
+    }
+    v = PyLong_AsLong(value);
+    if (v == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (v == OTAMAPY_ATTR_UNSET) {
+        PyErr_SetString(PyExc_OverflowError, "attribute value out of range");
+        return -1;
+    }
+    if (!(name = PyUnicode_AsUTF8(key))) {
+        return -1;
+    }
+    if (!(kv->name = PyMem_Malloc(strlen(name) + 1))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    strcpy(kv->name, name);
+    kv->value = v;
+
+    return 0;
+}
+
+/*
+ * copy attrs, a dict of str -> int, out of Python so the table can be
+ * updated under attrs_lock without touching Python objects.
+ * @return 0 or -1 with an exception set
+ */
+static int
+attr_parse(PyObject *attrs, attr_kv_t **kv, int *n)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0, size;
+    int err = 0;
+
+    *kv = NULL;
+    *n = 0;
+    if (!PyDict_Check(attrs)) {
+        PyErr_SetString(PyExc_TypeError, "attributes must be a dict");
+        return -1;
+    }
+    if ((size = PyDict_Size(attrs)) == 0) {
+        return 0;
+    }
+    *kv = PyMem_Calloc(size, sizeof(attr_kv_t));
+    if (!*kv) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    Py_BEGIN_CRITICAL_SECTION(attrs);
+    while (!err && *n < size && PyDict_Next(attrs, &pos, &key, &value)) {
+        Py_INCREF(key);
+        Py_INCREF(value);
+        if (!(err = attr_parse_item(key, value, &(*kv)[*n]))) {
+            ++*n;
+        }
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+    Py_END_CRITICAL_SECTION();
+    if (err < 0) {
+        attr_kv_free(*kv, *n);
+        *kv = NULL;
+        *n = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* @return 0 or -1 when out of memory */
+static int
+attr_table_set(attr_table_t *t, const otama_id_t *id, const attr_kv_t *kv, int n)
+{
+    long row = attr_table_row(t, id);
+    int i;
+
+    if (row < 0) {
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        int c = attr_table_column(t, kv[i].name, 1);
+        if (c < 0) {
+            return -1;
+        }
+        t->columns[c].values[row] = kv[i].value;
+        attr_log(t, id, kv[i].name, kv[i].value);
+    }
+
+    return 0;
+}
+
+/*
+ * replay the attrs file at path and keep appending to it. a torn
+ * record at the end is cut off first, as in dedup_open().
+ * @return 0 or -1 with errno set
+ */
+static int
+attr_table_open(attr_table_t *t, const char *path)
+{
+    otama_id_t id;
+    attr_kv_t kv = {NULL, 0};
+    off_t whole = 0;
+    struct stat st;
+    int len, err = 0;
+    FILE *fp;
+
+    if (t->fp) {
+        /* not while replaying */
+        fclose(t->fp);
+        t->fp = NULL;
+    }
+    if ((fp = fopen(path, "rb"))) {
+        while (!err && fread(&id, sizeof(id), 1, fp) == 1
+               && fread(&len, sizeof(len), 1, fp) == 1) {
+            if (len < 0) {
+                attr_table_delete(t, &id);
+            }
+            else {
+                if (!(kv.name = PyMem_Malloc((size_t)len + 1))) {
+                    err = -1;
+                    break;
+                }
+                if (fread(kv.name, 1, len, fp) != (size_t)len
+                    || fread(&kv.value, sizeof(kv.value), 1, fp) != 1) {
+                    PyMem_Free(kv.name);
+                    break;
+                }
+                kv.name[len] = '\0';
+                err = attr_table_set(t, &id, &kv, 1);
+                PyMem_Free(kv.name);
+            }
+            whole = ftello(fp);
+        }
+        fclose(fp);
+        if (err < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        if (stat(path, &st) == 0 && st.st_size > whole
+            && truncate(path, whole) < 0) {
+            return -1;
+        }
+    }
+    if (!(t->fp = fopen(path, "ab"))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * compile where (name -> int, all must be equal) into conds, which has
+ * room for n. @return number of conditions, -1 when where names an
+ * unknown attribute, so nothing matches.
+ */
+static int
+attr_filter_compile(attr_table_t *t, const attr_kv_t *where, int n,
+                    attr_cond_t *conds)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        int c = attr_table_column(t, where[i].name, 0);
+        if (c < 0) {
+            return -1;
+        }
+        conds[i].column = c;
+        conds[i].value = where[i].value;
+    }
+
+    return n;
+}
+
+static int
+attr_row_match(const attr_table_t *t, long row, const attr_cond_t *conds, int nconds)
+{
+    int i;
+
+    for (i = 0; i < nconds; ++i) {
+        if (t->columns[conds[i].column].values[row] != conds[i].value) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int
+attr_match(const attr_table_t *t, const otama_id_t *id,
+           const attr_cond_t *conds, int nconds)
+{
+    long row;
+
+    if (nconds == 0) {
+        return 1;
+    }
+    if (nconds < 0 || (row = attr_table_find(t, id)) < 0) {
+        return 0;
+    }
+
+    return attr_row_match(t, row, conds, nconds);
+}
+
+/* @return number of rows the conditions accept */
+static long
+attr_count_matches(const attr_table_t *t, const attr_cond_t *conds, int nconds)
+{
+    long row, n = 0;
+
+    if (nconds < 0) {
+        return 0;
+    }
+    for (row = 0; row < t->nrows; ++row) {
+        n += attr_row_match(t, row, conds, nconds);
+    }
+
+    return n;
+}
+
+/* make_results() for the hits at the given result indices */
+static PyObject *
+make_filtered_results(const otama_result_t *results, const long *hits, long nhits)
+{
+    PyObject *result_tuple;
+    long i;
+
+    result_tuple = PyTuple_New(nhits);
+    if (!result_tuple) {
+        return NULL;
+    }
+    for (i = 0; i < nhits; ++i) {
+        PyTuple_SetItem(result_tuple, i, make_result(results, hits[i]));
+    }
+
+    return result_tuple;
+}
+
+#ifdef _OPENMP
+/* the OpenMP team size before any handle changed it */
+static int default_scan_threads;
+static pthread_once_t default_scan_threads_once = PTHREAD_ONCE_INIT;
+
+static void
+save_default_scan_threads(void)
+{
+    default_scan_threads = omp_get_max_threads();
+}
+#endif
+
+/*
+ * set the thread count libotama's OpenMP scan uses on the calling thread;
+ * 0 restores the default, which a previous call may have changed.
+ * a no-op when built without OpenMP.
+ */
+static void
+set_scan_threads(int threads)
+{
+#ifdef _OPENMP
+    pthread_once(&default_scan_threads_once, save_default_scan_threads);
+    omp_set_num_threads(threads > 0 ? threads : default_scan_threads);
+#endif
+}
+
+/* decode-time downscaling of JPEG queries and inserts */
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} jpeg_error_t;
+
+static void
+jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((jpeg_error_t *)cinfo->err)->jmp, 1);
+}
+
+static void
+jpeg_output_message(j_common_ptr cinfo)
+{
+}
+
+/*
+ * decode the JPEG at path with DCT scaling (1/2, 1/4 or 1/8), keeping the
+ * longer side >= max_side, and re-encode it into *buf (free() it).
+ * plain C, call it without the GIL.
+ * @return 1 with *buf set, 0 when the file is not a JPEG, is already
+ *         small, or fails to decode: use the file as is then.
+ */
+static int
+downscale_jpeg(const char *path, int max_side,
+               unsigned char **buf, unsigned long *size)
+{
+    struct jpeg_decompress_struct din;
+    struct jpeg_compress_struct cout;
+    jpeg_error_t jerr;
+    unsigned char magic[2];
+    unsigned char *volatile row = NULL;
+    volatile int compressing = 0;
+    unsigned int longest, denom = 1;
+    long long t0;
+    FILE *fp;
+
+    *buf = NULL;
+    *size = 0;
+    if (max_side <= 0 || !(fp = fopen(path, "rb"))) {
+        return 0;
+    }
+    if (fread(magic, 1, 2, fp) != 2 || magic[0] != 0xff || magic[1] != 0xd8) {
+        fclose(fp);
+        return 0;
+    }
+    rewind(fp);
+    t0 = trace_begin();
+
+    din.err = jpeg_std_error(&jerr.pub);
+    cout.err = &jerr.pub;
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.pub.output_message = jpeg_output_message;
+    if (setjmp(jerr.jmp)) {
+        if (compressing) {
+            jpeg_destroy_compress(&cout);
+        }
+        jpeg_destroy_decompress(&din);
+        fclose(fp);
+        free(row);
+        free(*buf);
+        *buf = NULL;
+        *size = 0;
+        return 0;
+    }
+    jpeg_create_decompress(&din);
+    jpeg_stdio_src(&din, fp);
+    jpeg_read_header(&din, TRUE);
+
+    longest = din.image_width > din.image_height ? din.image_width : din.image_height;
+    while (denom < 8 && longest / (denom * 2) >= (unsigned int)max_side) {
+        denom *= 2;
+    }
+    if (denom == 1
+        || din.jpeg_color_space == JCS_CMYK || din.jpeg_color_space == JCS_YCCK) {
+        jpeg_destroy_decompress(&din);
+        fclose(fp);
+        return 0;
+    }
+    din.scale_num = 1;
+    din.scale_denom = denom;
+    jpeg_start_decompress(&din);
+
+    jpeg_create_compress(&cout);
+    compressing = 1;
+    jpeg_mem_dest(&cout, buf, size);
+    cout.image_width = din.output_width;
+    cout.image_height = din.output_height;
+    cout.input_components = din.output_components;
+    cout.in_color_space = din.out_color_space;
+    jpeg_set_defaults(&cout);
+    jpeg_set_quality(&cout, 95, TRUE);
+    jpeg_start_compress(&cout, TRUE);
+
+    row = malloc((size_t)din.output_width * din.output_components);
+    if (!row) {
+        longjmp(jerr.jmp, 1);
+    }
+    while (din.output_scanline < din.output_height) {
+        JSAMPROW rows[1];
+        rows[0] = row;
+        jpeg_read_scanlines(&din, rows, 1);
+        jpeg_write_scanlines(&cout, rows, 1);
+    }
+    jpeg_finish_compress(&cout);
+    jpeg_finish_decompress(&din);
+    jpeg_destroy_compress(&cout);
+    jpeg_destroy_decompress(&din);
+    fclose(fp);
+    free(row);
+    trace_end("decode", t0);
+
+    return 1;
+}
+
+/*
+ * a query dict {'file': path} as {'data': downscaled bytes}.
+ * @return new reference, query itself when nothing was downscaled
+ */
+static PyObject *
+downscale_query(PyObject *query, int max_side)
+{
+    PyObject *file, *utf8_item, *data, *copy;
+    const char *path;
+    unsigned char *buf;
+    unsigned long size;
+    int scaled;
+
+    if (max_side <= 0 || !PyDict_Check(query)
+        || otamapy_dict_get(query, "file", &file) <= 0) {
+        PyErr_Clear();
+        Py_INCREF(query);
+        return query;
+    }
+    if (!(path = pyobj2str(file, &utf8_item))) {
+        PyErr_Clear();
+        Py_DECREF(file);
+        Py_INCREF(query);
+        return query;
+    }
+    /* path may point into file, which our reference keeps alive even
+     * if another thread replaces it in the dict meanwhile */
+    Py_BEGIN_ALLOW_THREADS
+    scaled = downscale_jpeg(path, max_side, &buf, &size);
+    Py_END_ALLOW_THREADS
+    Py_XDECREF(utf8_item);
+    Py_DECREF(file);
+    if (!scaled) {
+        Py_INCREF(query);
+        return query;
+    }
+
+    data = PyBytes_FromStringAndSize((const char *)buf, size);
+    free(buf);
+    copy = data ? PyDict_Copy(query) : NULL;
+    if (!copy || PyDict_DelItemString(copy, "file") < 0
+        || PyDict_SetItemString(copy, "data", data) < 0) {
+        Py_XDECREF(data);
+        Py_XDECREF(copy);
+        return NULL;
+    }
+    Py_DECREF(data);
+
+    return copy;
+}
+
+/*
+ * a per-call max_side argument: None (or omitted) keeps the handle's.
+ * @return 0 or -1 with an exception set
+ */
+static int
+otamapy_arg_max_side(PyObject *obj, int *max_side)
+{
+    long n;
+
+    if (!obj || obj == Py_None) {
+        return 0;
+    }
+    n = PyLong_AsLong(obj);
+    if (n == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (n < 0 || n > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "max_side must be >= 0");
+        return -1;
+    }
+    *max_side = (int)n;
+
+    return 0;
+}
+
+/*
+ * a config converted for otama_open()/otama_open_opt(), so the open
+ * itself can run without the GIL. plain malloc, freed off the GIL too.
+ */
+typedef struct {
+    char *path;
+    otama_variant_pool_t *pool;
+    otama_variant_t *var;
+} open_args_t;
+
+static void
+open_args_free(open_args_t *oa)
+{
+    free(oa->path);
+    if (oa->pool) {
+        otama_variant_pool_free(&oa->pool);
+    }
+    memset(oa, 0, sizeof(open_args_t));
+}
+
+/*
+ * take an int >= min out of *config under key, copying the dict on the
+ * first key taken so the caller's dict is left alone.
+ * @return 0 or -1 with an exception set
+ */
+static int
+config_take_int(PyObject **config, int *copied, const char *key, long min,
+                int *value)
+{
+    PyObject *item;
+    long n;
+    int found = otamapy_dict_get(*config, key, &item);
+
+    if (found <= 0) {
+        return found;
+    }
+    n = PyLong_AsLong(item);
+    Py_DECREF(item);
+    if (n == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (n < min || n > INT_MAX) {
+        PyErr_Format(PyExc_ValueError, "%s must be >= %ld", key, min);
+        return -1;
+    }
+    *value = (int)n;
+    if (!*copied) {
+        PyObject *copy = PyDict_Copy(*config);
+        if (!copy) {
+            return -1;
+        }
+        *config = copy;
+        *copied = 1;
+    }
+
+    return PyDict_DelItemString(*config, key);
+}
+
+/* config_take_int() for a file name, copied into buf */
+static int
+config_take_path(PyObject **config, int *copied, const char *key,
+                 char *buf, size_t size)
+{
+    PyObject *item, *utf8_item;
+    const char *path;
+    int found = otamapy_dict_get(*config, key, &item);
+
+    if (found <= 0) {
+        return found;
+    }
+    path = pyobj2str(item, &utf8_item);
+    if (!path) {
+        Py_DECREF(item);
+        if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_TypeError, "%s must be a str", key);
+        }
+        return -1;
+    }
+    if (strlen(path) >= size) {
+        Py_XDECREF(utf8_item);
+        Py_DECREF(item);
+        PyErr_Format(PyExc_ValueError, "%s is too long", key);
+        return -1;
+    }
+    strcpy(buf, path);
+    Py_XDECREF(utf8_item);
+    Py_DECREF(item);
+    if (!*copied) {
+        PyObject *copy = PyDict_Copy(*config);
+        if (!copy) {
+            return -1;
+        }
+        *config = copy;
+        *copied = 1;
+    }
+
+    return PyDict_DelItemString(*config, key);
+}
+
+/*
+ * convert a config file path or a config dict.
+ * 'threads', 'max_side', 'coalesce', 'dedup_file' and 'attrs_file' keys in
+ * a config dict are consumed here, not by libotama.
+ * @return 0 or -1 with an exception set
+ */
+static int
+prepare_config(otamapy_state *st, open_args_t *oa, PyObject *config,
+               open_opts_t *opts)
+{
+    memset(oa, 0, sizeof(open_args_t));
+    memset(opts, 0, sizeof(open_opts_t));
+
+    if (PyBytes_Check(config) || PyUnicode_Check(config)) {
+        PyObject *utf8_item;
+        const char *path = pyobj2str(config, &utf8_item);
+        if (!path) {
+            PyErr_SetString(st->error, "don't gen utf8 item");
+            return -1;
+        }
+        oa->path = strdup(path);
+        Py_XDECREF(utf8_item);
+        if (!oa->path) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    else if (PyDict_Check(config)) {
+        int copied = 0, err;
+
+        if (config_take_int(&config, &copied, "threads", 1, &opts->threads) < 0
+            || config_take_int(&config, &copied, "max_side", 0, &opts->max_side) < 0
+            || config_take_int(&config, &copied, "coalesce", 0, &opts->coalesce) < 0
+            || config_take_path(&config, &copied, "dedup_file", opts->dedup_file,
+                                sizeof(opts->dedup_file)) < 0
+            || config_take_path(&config, &copied, "attrs_file", opts->attrs_file,
+                                sizeof(opts->attrs_file)) < 0) {
+            if (copied) {
+                Py_DECREF(config);
+            }
+            return -1;
+        }
+
+        oa->pool = otama_variant_pool_alloc();
+        oa->var = otama_variant_new(oa->pool);
+
+        err = pyobj2variant(st, config, oa->var);
+        if (copied) {
+            Py_DECREF(config);
+        }
+        if (err < 0) {
+            return -1;
+        }
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError, "not support type.");
+        return -1;
+    }
+
+    return 0;
+}
+
+static otama_status_t
+open_prepared(otama_t **otama, open_args_t *oa)
+{
+    if (oa->path) {
+        return otama_open(otama, oa->path);
+    }
+
+    return otama_open_opt(otama, oa->var);
+}
+
+/*
+ * open *otama from a config file path or a config dict.
+ * @return 0 or -1 with an exception set
+ */
+static int
+open_config(otamapy_state *st, otama_t **otama, PyObject *config,
+            open_opts_t *opts)
+{
+    open_args_t oa;
+    otama_status_t ret;
+
+    if (prepare_config(st, &oa, config, opts) < 0) {
+        return -1;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    long long t0 = trace_begin();
+    ret = open_prepared(otama, &oa);
+    trace_end("open", t0);
+    open_args_free(&oa);
+    Py_END_ALLOW_THREADS
+
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(st, ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+#define OTAMAPY_FNV_OFFSET 14695981039346656037ULL
+
+static unsigned long long
+fnv1a(unsigned long long h, const unsigned char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= buf[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+/* 64-bit FNV-1a of the file contents, used to route and dedup inserts */
+static int
+hash_file(const char *path, unsigned long long *hash)
+{
+    unsigned char buf[65536];
+    unsigned long long h = OTAMAPY_FNV_OFFSET;
+    size_t len;
+    FILE *fp = fopen(path, "rb");
+
+    if (!fp) {
+        return -1;
+    }
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        h = fnv1a(h, buf, len);
+    }
+    fclose(fp);
+    *hash = h ? h : 1;
+
+    return 0;
+}
+
+/* hash_file() of bytes in memory */
+static unsigned long long
+hash_data(const void *data, size_t size)
+{
+    unsigned long long h = fnv1a(OTAMAPY_FNV_OFFSET, data, size);
+
+    return h ? h : 1;
+}
+
+/* dedup table, run under attrs_lock with the GIL held */
+
+static dedup_entry_t *
+dedup_slot(const dedup_table_t *t, unsigned long long hash, int max_side)
+{
+    unsigned long i;
+
+    for (i = (hash ^ (unsigned int)max_side) % t->nslots; t->slots[i].hash;
+         i = (i + 1) % t->nslots) {
+        if (t->slots[i].hash == hash && t->slots[i].max_side == max_side) {
+            break;
+        }
+    }
+
+    return &t->slots[i];
+}
+
+/* @return 1 with *id set, or 0 */
+static int
+dedup_find(const dedup_table_t *t, unsigned long long hash, int max_side,
+           otama_id_t *id)
+{
+    dedup_entry_t *e;
+
+    if (t->nslots == 0) {
+        return 0;
+    }
+    e = dedup_slot(t, hash, max_side);
+    if (!e->hash) {
+        return 0;
+    }
+    *id = e->id;
+
+    return 1;
+}
+
+/* @return 0 or -1 when out of memory */
+static int
+dedup_set(dedup_table_t *t, unsigned long long hash, int max_side,
+          const otama_id_t *id)
+{
+    dedup_entry_t *e;
+
+    if ((t->count + 1) * 2 > t->nslots) {
+        long nslots = t->nslots ? t->nslots * 2 : 1024, i;
+        dedup_table_t grown = *t;
+
+        grown.slots = PyMem_Malloc(sizeof(dedup_entry_t) * nslots);
+        if (!grown.slots) {
+            return -1;
+        }
+        memset(grown.slots, 0, sizeof(dedup_entry_t) * nslots);
+        grown.nslots = nslots;
+        for (i = 0; i < t->nslots; ++i) {
+            if (t->slots[i].hash) {
+                *dedup_slot(&grown, t->slots[i].hash, t->slots[i].max_side) = t->slots[i];
+            }
+        }
+        PyMem_Free(t->slots);
+        *t = grown;
+    }
+    e = dedup_slot(t, hash, max_side);
+    if (!e->hash) {
+        t->count++;
+    }
+    e->hash = hash;
+    e->max_side = max_side;
+    e->id = *id;
+
+    return 0;
+}
+
+/*
+ * record a new entry in the dedup file. records are the entry fields
+ * back to back in host byte order; the file belongs to one host.
+ */
+static void
+dedup_append(dedup_table_t *t, const dedup_entry_t *e)
+{
+    if (t->fp) {
+        fwrite(&e->hash, sizeof(e->hash), 1, t->fp);
+        fwrite(&e->max_side, sizeof(e->max_side), 1, t->fp);
+        fwrite(&e->id, sizeof(e->id), 1, t->fp);
+        fflush(t->fp);
+    }
+}
+
+/* bytes of one dedup_append() record */
+#define OTAMAPY_DEDUP_RECORD \
+    (sizeof(unsigned long long) + sizeof(int) + sizeof(otama_id_t))
+
+/*
+ * load path and keep appending to it. a torn record at the end (a
+ * crash mid-append) is cut off first, so later records stay aligned.
+ * @return 0 or -1 with errno set
+ */
+static int
+dedup_open(dedup_table_t *t, const char *path)
+{
+    dedup_entry_t e;
+    off_t whole = 0;
+    struct stat st;
+    FILE *fp = fopen(path, "rb");
+
+    if (fp) {
+        while (fread(&e.hash, sizeof(e.hash), 1, fp) == 1
+               && fread(&e.max_side, sizeof(e.max_side), 1, fp) == 1
+               && fread(&e.id, sizeof(e.id), 1, fp) == 1) {
+            if (dedup_set(t, e.hash, e.max_side, &e.id) < 0) {
+                fclose(fp);
+                errno = ENOMEM;
+                return -1;
+            }
+            whole += OTAMAPY_DEDUP_RECORD;
+        }
+        fclose(fp);
+        if (stat(path, &st) == 0 && st.st_size > whole
+            && truncate(path, whole) < 0) {
+            return -1;
+        }
+    }
+    if (t->fp) {
+        fclose(t->fp);
+    }
+    if (!(t->fp = fopen(path, "ab"))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+dedup_free(dedup_table_t *t)
+{
+    if (t->fp) {
+        fclose(t->fp);
+    }
+    PyMem_Free(t->slots);
+    memset(t, 0, sizeof(dedup_table_t));
+}
+
+/*
+ * @return PyObject *self or NULL
+ */
+static PyObject *
+setup_config(OtamaObject *self, PyObject *config)
+{
+    if (config) {
+        if (open_config(self->state, &self->otama, config, &self->opts) < 0) {
+            return NULL;
+        }
+        if (self->opts.dedup_file[0]) {
+            int err;
+            otamapy_lock(&self->attrs_lock);
+            err = dedup_open(&self->dedup, self->opts.dedup_file);
+            pthread_mutex_unlock(&self->attrs_lock);
+            if (err < 0) {
+                if (errno == ENOMEM) {
+                    return PyErr_NoMemory();
+                }
+                return PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+                                                      self->opts.dedup_file);
+            }
+        }
+        if (self->opts.attrs_file[0]) {
+            int err;
+            otamapy_lock(&self->attrs_lock);
+            err = attr_table_open(&self->attrs, self->opts.attrs_file);
+            pthread_mutex_unlock(&self->attrs_lock);
+            if (err < 0) {
+                if (errno == ENOMEM) {
+                    return PyErr_NoMemory();
+                }
+                return PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+                                                      self->opts.attrs_file);
+            }
+        }
+        Py_INCREF(config);
+        Py_XDECREF(self->config);
+        self->config = config;
+    }
+
+    return (PyObject *)self;
+}
+
+/* tp_free, then drop the reference every heap type instance holds */
+static void
+Otama_free_instance(PyObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    tp->tp_free(self);
+    Py_DECREF(tp);
+}
+
+static void
+Otama_dealloc(OtamaObject *self)
+{
+    if (self->jobs) {
+        /* background jobs still use the handle and its lock */
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->lock);
+        while (self->jobs) {
+            pthread_cond_wait(&self->jobs_cond, &self->lock);
+        }
+        pthread_mutex_unlock(&self->lock);
+        Py_END_ALLOW_THREADS
+    }
+    if (self->otama) {
+        otama_close(&(self->otama));
+        self->otama = NULL;
+    }
+    pthread_mutex_destroy(&self->lock);
+    pthread_mutex_destroy(&self->attrs_lock);
+    pthread_mutex_destroy(&self->flights_lock);
+    pthread_cond_destroy(&self->jobs_cond);
+    attr_table_free(&self->attrs);
+    dedup_free(&self->dedup);
+    Py_XDECREF(self->config);
+    Otama_free_instance((PyObject *)self);
+}
+
+/* alloc an Otama-shaped object with its locks and module state ready */
+static OtamaObject *
+Otama_alloc_instance(PyTypeObject *type)
+{
+    otamapy_state *st = otamapy_get_state(type);
+    OtamaObject *self;
+
+    if (!st) {
+        return NULL;
+    }
+    self = (OtamaObject *)type->tp_alloc(type, 0);
+    if (self) {
+        self->state = st;
+        pthread_mutex_init(&self->lock, NULL);
+        pthread_mutex_init(&self->attrs_lock, NULL);
+        pthread_mutex_init(&self->flights_lock, NULL);
+        pthread_cond_init(&self->jobs_cond, NULL);
+    }
+
+    return self;
+}
+
+static PyObject *
+otama_create(PyTypeObject *type, PyObject *config)
+{
+    OtamaObject *self;
+
+    self = Otama_alloc_instance(type);
+    if (self) {
+        if (!setup_config(self, config)) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+
+    return (PyObject *)self;
+}
+
+static int
+OtamaObject_init(OtamaObject *self, PyObject *args)
+{
+    return 0;
+}
+
+static PyObject *
+OtamaObject_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"config", NULL};
+    PyObject *config = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &config)) {
+        PyErr_SetString(PyExc_TypeError, "argument error");
+        return NULL;
+    }
+
+    return otama_create(type, config);
+}
+
+/* Otama(config) without the argument tuple; tp_init is a no-op */
+static PyObject *
+OtamaObject_vectorcall(PyObject *type, PyObject *const *args,
+                       size_t nargsf, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"config", NULL};
+    PyObject *config = NULL;
+
+    if (otamapy_unpack(args, PyVectorcall_NARGS(nargsf), kwnames,
+                       kwlist, 0, &config) < 0) {
+        return NULL;
+    }
+
+    return otama_create((PyTypeObject *)type, config);
+}
+
+static PyObject *
+OtamaObject_open(PyTypeObject *type, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"config", NULL};
+    PyObject *config = NULL;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 0, &config) < 0) {
+        return NULL;
+    }
+
+    return otama_create(type, config);
+}
+
+static PyObject *
+OtamaObject_close(OtamaObject *self)
+{
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->lock);
+    if (self->otama) {
+        otama_close(&self->otama);
+        self->otama = NULL;
+    }
+    pthread_mutex_unlock(&self->lock);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+OtamaObject_pull(OtamaObject *self)
+{
+    otama_status_t ret;
+
+    OTAMAPY_TRACED_CALL(self, ret, "pull", otama_pull(self->otama));
+    otamapy_log_flush(self->state);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+OtamaObject_create_database(OtamaObject *self)
+{
+    otama_status_t ret;
+
+    if (!self->otama) {
+        PyErr_SetString(self->state->error, "not initialize/config error");
+        return NULL;
+    }
+
+    OTAMAPY_WRITE_CALL(self, ret, otama_create_database(self->otama));
+    otamapy_log_flush(self->state);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+static PyObject *
+OtamaObject_drop_database(OtamaObject *self)
+{
+    otama_status_t ret;
+
+    if (!self->otama) {
+        PyErr_SetString(self->state->error, "not initialize/config error");
+        return NULL;
+    }
+
+    OTAMAPY_WRITE_CALL(self, ret, otama_drop_database(self->otama));
+    otamapy_log_flush(self->state);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+OtamaObject_create_table(OtamaObject *self)
+{
+    otama_status_t ret;
+
+    if (PyErr_WarnEx(PyExc_DeprecationWarning,
+                     "This API is deprecated, rename to create_database", 1) < 0) {
+        return NULL;
+    }
+
+    if (!self->otama) {
+        PyErr_SetString(self->state->error, "not initialize/config error");
+        return NULL;
+    }
+
+    OTAMAPY_WRITE_CALL(self, ret, otama_create_database(self->otama));
+    otamapy_log_flush(self->state);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+static PyObject *
+OtamaObject_drop_table(OtamaObject *self)
+{
+    otama_status_t ret;
+
+    if (PyErr_WarnEx(PyExc_DeprecationWarning,
+                     "This API is deprecated, rename to drop_database", 1) < 0) {
+        return NULL;
+    }
+
+    if (!self->otama) {
+        PyErr_SetString(self->state->error, "not initialize/config error");
+        return NULL;
+    }
+
+    OTAMAPY_WRITE_CALL(self, ret, otama_drop_database(self->otama));
+    otamapy_log_flush(self->state);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+/* OtamaIndexJob Object: drop_index/vacuum_index run in the background */
+
+#define OTAMAPY_JOB_NICE 10
+
+typedef enum {
+    INDEX_JOB_RUNNING,
+    INDEX_JOB_SWAPPING,
+    INDEX_JOB_DONE,
+    INDEX_JOB_CANCELLED,
+    INDEX_JOB_FAILED
+} index_job_state_t;
+
+static const char *index_job_state_names[] = {
+    "running", "swapping", "done", "cancelled", "failed"
+};
+
+/*
+ * shared by the job object and its detached worker thread, freed by
+ * whichever lets go last, so dropping the job object never waits.
+ */
+typedef struct {
+    OtamaObject *owner;         /* kept alive by owner->jobs */
+    otama_status_t (*op)(otama_t *);
+    open_args_t open_args;
+    int refs;                   /* under mutex */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    index_job_state_t state;
+    int cancelled;
+    otama_status_t ret;
+} index_job_t;
+
+typedef struct {
+    PyObject_HEAD
+    OtamaObject *owner;
+    index_job_t *job;
+} OtamaIndexJobObject;
+
+static void
+index_job_release(index_job_t *job)
+{
+    int last;
+
+    pthread_mutex_lock(&job->mutex);
+    last = --job->refs == 0;
+    pthread_mutex_unlock(&job->mutex);
+    if (last) {
+        open_args_free(&job->open_args);
+        pthread_mutex_destroy(&job->mutex);
+        pthread_cond_destroy(&job->cond);
+        free(job);
+    }
+}
+
+/*
+ * rebuild through a private handle, then pull the owner so its searches
+ * switch to the new index. the owner keeps searching its loaded copy
+ * until that pull.
+ */
+static void *
+index_job_worker(void *arg)
+{
+    index_job_t *job = (index_job_t *)arg;
+    OtamaObject *owner = job->owner;
+    otama_t *otama = NULL;
+    otama_status_t ret;
+    const char *name = job->op == otama_drop_index ? "drop_index" : "vacuum_index";
+    long long t0;
+    int swap;
+
+#ifdef __linux__
+    /* lower only this thread, so the rebuild yields to foreground queries */
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), OTAMAPY_JOB_NICE);
+#endif
+    set_scan_threads(1);
+
+    t0 = trace_begin();
+    ret = open_prepared(&otama, &job->open_args);
+    open_args_free(&job->open_args);
+    if (ret == OTAMA_STATUS_OK) {
+        ret = job->op(otama);
+        otama_close(&otama);
+    }
+    trace_end(name, t0);
+
+    pthread_mutex_lock(&job->mutex);
+    swap = ret == OTAMA_STATUS_OK && !job->cancelled;
+    if (swap) {
+        job->state = INDEX_JOB_SWAPPING;
+    }
+    pthread_mutex_unlock(&job->mutex);
+
+    pthread_mutex_lock(&owner->lock);
+    if (swap) {
+        ret = owner->otama ? otama_pull(owner->otama) : OTAMA_STATUS_INVALID_ARGUMENTS;
+    }
+    owner->rebuilding--;
+    pthread_cond_broadcast(&owner->jobs_cond);
+    pthread_mutex_unlock(&owner->lock);
+
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_log(owner->state, OTAMA_LOG_LEVEL_ERROR, "background %s failed: %s",
+                    name, otama_status_message(ret));
+    }
+    else {
+        otamapy_log(owner->state, OTAMA_LOG_LEVEL_NOTICE, "background %s %s",
+                    name, swap ? "done" : "cancelled");
+    }
+
+    pthread_mutex_lock(&job->mutex);
+    job->ret = ret;
+    if (ret != OTAMA_STATUS_OK) {
+        job->state = INDEX_JOB_FAILED;
+    }
+    else {
+        job->state = swap ? INDEX_JOB_DONE : INDEX_JOB_CANCELLED;
+    }
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->mutex);
+
+    /* owner may go away from here on */
+    pthread_mutex_lock(&owner->lock);
+    owner->jobs--;
+    pthread_cond_broadcast(&owner->jobs_cond);
+    pthread_mutex_unlock(&owner->lock);
+    index_job_release(job);
+
+    return NULL;
+}
+
+static PyObject *
+index_job_start(OtamaObject *self, otama_status_t (*op)(otama_t *))
+{
+    OtamaIndexJobObject *obj;
+    index_job_t *job;
+    open_opts_t opts;
+    pthread_t thread;
+
+    if (!self->otama || !self->config) {
+        PyErr_SetString(self->state->error, "not initialize/config error");
+        return NULL;
+    }
+
+    obj = (OtamaIndexJobObject *)self->state->index_job_type->tp_alloc(
+        self->state->index_job_type, 0);
+    if (!obj) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    obj->owner = self;
+    if (!(job = calloc(1, sizeof(index_job_t)))) {
+        Py_DECREF(obj);
+        return PyErr_NoMemory();
+    }
+    pthread_mutex_init(&job->mutex, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    job->refs = 1;
+    obj->job = job;
+
+    if (prepare_config(self->state, &job->open_args, self->config, &opts) < 0) {
+        Py_DECREF(obj);
+        return NULL;
+    }
+    job->owner = self;
+    job->op = op;
+    job->state = INDEX_JOB_RUNNING;
+
+    otamapy_lock(&self->lock);
+    self->jobs++;
+    self->rebuilding++;
+    job->refs++;
+    if (pthread_create(&thread, NULL, index_job_worker, job) != 0) {
+        self->jobs--;
+        self->rebuilding--;
+        job->refs--;
+        pthread_mutex_unlock(&self->lock);
+        PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(obj);
+        return NULL;
+    }
+    pthread_mutex_unlock(&self->lock);
+    pthread_detach(thread);
+
+    return (PyObject *)obj;
+}
+
+static void
+IndexJob_dealloc(OtamaIndexJobObject *self)
+{
+    if (self->job) {
+        index_job_release(self->job);
+    }
+    Py_XDECREF(self->owner);
+    Otama_free_instance((PyObject *)self);
+}
+
+static PyObject *
+OtamaIndexJobObject_done(OtamaIndexJobObject *self)
+{
+    int done;
+
+    pthread_mutex_lock(&self->job->mutex);
+    done = self->job->state >= INDEX_JOB_DONE;
+    pthread_mutex_unlock(&self->job->mutex);
+    otamapy_log_flush(self->owner->state);
+
+    return PyBool_FromLong(done);
+}
+
+static PyObject *
+OtamaIndexJobObject_wait(OtamaIndexJobObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"timeout", NULL};
+    PyObject *timeout = Py_None;
+    double seconds = -1.0;
+    index_job_state_t state;
+    otama_status_t ret;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 0, &timeout) < 0) {
+        return NULL;
+    }
+    if (timeout != Py_None) {
+        seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (seconds < 0.0) {
+            seconds = 0.0;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->job->mutex);
+    if (seconds < 0.0) {
+        while (self->job->state < INDEX_JOB_DONE) {
+            pthread_cond_wait(&self->job->cond, &self->job->mutex);
+        }
+    }
+    else {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)seconds;
+        deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (self->job->state < INDEX_JOB_DONE) {
+            if (pthread_cond_timedwait(&self->job->cond, &self->job->mutex, &deadline) != 0) {
+                break;
+            }
+        }
+    }
+    state = self->job->state;
+    ret = self->job->ret;
+    pthread_mutex_unlock(&self->job->mutex);
+    Py_END_ALLOW_THREADS
+    otamapy_log_flush(self->owner->state);
+
+    if (state == INDEX_JOB_FAILED) {
+        otamapy_raise(self->owner->state, ret);
+        return NULL;
+    }
+
+    return PyBool_FromLong(state >= INDEX_JOB_DONE);
+}
+
+static PyObject *
+OtamaIndexJobObject_cancel(OtamaIndexJobObject *self)
+{
+    int cancelled = 0;
+
+    pthread_mutex_lock(&self->job->mutex);
+    if (self->job->state == INDEX_JOB_RUNNING) {
+        self->job->cancelled = 1;
+        cancelled = 1;
+    }
+    pthread_mutex_unlock(&self->job->mutex);
+
+    return PyBool_FromLong(cancelled);
+}
+
+static PyObject *
+OtamaIndexJobObject_get_state(OtamaIndexJobObject *self, void *closure)
+{
+    index_job_state_t state;
+
+    pthread_mutex_lock(&self->job->mutex);
+    state = self->job->state;
+    pthread_mutex_unlock(&self->job->mutex);
+
+    return PyUnicode_FromString(index_job_state_names[state]);
+}
+
+/*
+ * run op in the foreground, or on a background job when asked.
+ */
+static PyObject *
+OtamaObject_index_op(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+                     otama_status_t (*op)(otama_t *))
+{
+    static const char *const kwlist[] = {"background", NULL};
+    PyObject *background = NULL;
+    otama_status_t ret;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 0, &background) < 0) {
+        return NULL;
+    }
+
+    if (!self->otama) {
+        PyErr_SetString(self->state->error, "not initialize/config error");
+        return NULL;
+    }
+
+    if (background && PyObject_IsTrue(background)) {
+        return index_job_start(self, op);
+    }
+
+    OTAMAPY_WRITE_CALL(self, ret, op(self->otama));
+    otamapy_log_flush(self->state);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+OtamaObject_drop_index(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return OtamaObject_index_op(self, args, nargs, kwnames, otama_drop_index);
+}
+
+static PyObject *
+OtamaObject_vacuum_index(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return OtamaObject_index_op(self, args, nargs, kwnames, otama_vacuum_index);
+}
+
+static PyObject *
+search_run(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"num", "data", "where", "max_side", NULL};
+    int num, fetch, pass, nwhere = 0, nconds = 0, max_side = self->opts.max_side;
+    long matches = -1, nhits = 0;
+    long *hits = NULL;
+    otama_status_t ret;
+    otama_result_t *results = NULL;
+    otama_variant_pool_t *pool;
+    otama_variant_t *var;
+    attr_kv_t *kv = NULL;
+    attr_cond_t *conds = NULL;
+    PyObject *argv[4] = {NULL, NULL, NULL, NULL};
+    PyObject *data, *where, *utf8_item;
+    PyObject *result_tuple;
+    const char *path;
+    unsigned char *scaled = NULL;
+    unsigned long scaled_size = 0;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 2, argv) < 0
+        || otamapy_arg_int(argv[0], &num) < 0
+        || otamapy_arg_max_side(argv[3], &max_side) < 0) {
+        return NULL;
+    }
+    data = argv[1];
+    where = argv[2];
+
+    if (!self->otama) {
+        PyErr_SetString(self->state->error, "not initialize/config error");
+        return NULL;
+    }
+
+    if (where && where != Py_None) {
+        if (attr_parse(where, &kv, &nwhere) < 0) {
+            return NULL;
+        }
+        if (nwhere > 0) {
+            conds = PyMem_Malloc(sizeof(attr_cond_t) * nwhere);
+            hits = PyMem_Malloc(sizeof(long) * (num > 0 ? num : 1));
+            if (!conds || !hits) {
+                attr_kv_free(kv, nwhere);
+                PyMem_Free(conds);
+                PyMem_Free(hits);
+                return PyErr_NoMemory();
+            }
+            otamapy_lock(&self->attrs_lock);
+            nconds = attr_filter_compile(&self->attrs, kv, nwhere, conds);
+            matches = attr_count_matches(&self->attrs, conds, nconds);
+            pthread_mutex_unlock(&self->attrs_lock);
+        }
+        attr_kv_free(kv, nwhere);
+        if (matches == 0) {
+            PyMem_Free(conds);
+            PyMem_Free(hits);
+            return PyTuple_New(0);
+        }
+    }
+
+    path = pyobj2str(data, &utf8_item);
+    if (!path && PyErr_Occurred()) {
+        PyMem_Free(conds);
+        PyMem_Free(hits);
+        return NULL;
+    }
+    if (path) {
+        struct stat st;
+        if (stat(path, &st)) {
+            PyErr_Format(PyExc_IOError, "not exist file %s", path);
+            Py_XDECREF(utf8_item);
+            PyMem_Free(conds);
+            PyMem_Free(hits);
+            return NULL;
+        }
+    }
+
+    if (path) {
+        Py_BEGIN_ALLOW_THREADS
+        downscale_jpeg(path, max_side, &scaled, &scaled_size);
+        Py_END_ALLOW_THREADS
+    }
+    else if (!(data = downscale_query(data, max_side))) {
+        PyMem_Free(conds);
+        PyMem_Free(hits);
+        return NULL;
+    }
+
+    pool = otama_variant_pool_alloc();
+    var = otama_variant_new(pool);
+    if (!path) {
+        // TODO: not implementation
+        otamapy_raw_rdlock();
+        if (pyobj2variant(self->state, data, var) < 0) {
+            pthread_rwlock_unlock(&raw_lock);
+            Py_DECREF(data);
+            otama_variant_pool_free(&pool);
+            PyMem_Free(conds);
+            PyMem_Free(hits);
+            return NULL;
+        }
+    }
+
+    /* with a filter, over-fetch and widen until num hits qualify, the
+     * namespace runs out, or OTAMAPY_WHERE_PASSES scans have run (each
+     * holds raw_lock). the attribute table can't size the first scan:
+     * images inserted without attributes are not in it */
+    fetch = num;
+    if (matches > 0 && num > 0) {
+        fetch = num < INT_MAX / OTAMAPY_WHERE_OVERFETCH
+            ? num * OTAMAPY_WHERE_OVERFETCH : INT_MAX;
+    }
+    for (pass = 1;; ++pass) {
+        long count, i;
+
+        Py_BEGIN_ALLOW_THREADS
+        long long t0;
+        pthread_mutex_lock(&self->lock);
+        set_scan_threads(self->opts.threads);
+        t0 = trace_begin();
+        if (!self->otama) {
+            ret = OTAMA_STATUS_INVALID_ARGUMENTS;
+        }
+        else if (scaled) {
+            ret = otama_search_data(self->otama, &results, fetch,
+                                    scaled, scaled_size);
+        }
+        else if (path) {
+            ret = otama_search_file(self->otama, &results, fetch, path);
+        }
+        else {
+            ret = otama_search(self->otama, &results, fetch, var);
+        }
+        trace_end("search", t0);
+        pthread_mutex_unlock(&self->lock);
+        Py_END_ALLOW_THREADS
+
+        if (ret != OTAMA_STATUS_OK || matches < 0) {
+            break;
+        }
+        count = otama_result_count(results);
+        nhits = 0;
+        otamapy_lock(&self->attrs_lock);
+        for (i = 0; i < count && nhits < num; ++i) {
+            if (attr_match(&self->attrs, otama_result_id(results, i),
+                           conds, nconds)) {
+                hits[nhits++] = i;
+            }
+        }
+        pthread_mutex_unlock(&self->attrs_lock);
+        if (nhits >= num || nhits >= matches || count < fetch
+            || pass >= OTAMAPY_WHERE_PASSES || fetch == INT_MAX) {
+            break;
+        }
+        otama_result_free(&results);
+        {
+            /* twice what the hit rate so far says num hits need */
+            double next = nhits > 0
+                ? 2.0 * fetch * num / nhits
+                : (double)fetch * OTAMAPY_WHERE_GROWTH;
+            if (next < 4.0 * fetch) {
+                next = 4.0 * fetch;
+            }
+            fetch = next < INT_MAX ? (int)next : INT_MAX;
+        }
+    }
+    if (!path) {
+        pthread_rwlock_unlock(&raw_lock);
+        Py_DECREF(data);
+    }
+    Py_XDECREF(utf8_item);
+    free(scaled);
+    otamapy_log_flush(self->state);
+
+    if (ret != OTAMA_STATUS_OK) {
+        otama_variant_pool_free(&pool);
+        PyMem_Free(conds);
+        PyMem_Free(hits);
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+    if (matches < 0) {
+        result_tuple = make_results(results);
+    }
+    else {
+        result_tuple = make_filtered_results(results, hits, nhits);
+    }
+
+    otama_result_free(&results);
+    otama_variant_pool_free(&pool);
+    PyMem_Free(conds);
+    PyMem_Free(hits);
+
+    return result_tuple;
+}
+
+static void
+search_flight_release(OtamaObject *self, search_flight_t *flight)
+{
+    int last;
+
+    otamapy_lock(&self->flights_lock);
+    last = --flight->refs == 0;
+    pthread_mutex_unlock(&self->flights_lock);
+    if (last) {
+        PyMem_Free(flight->path);
+        Py_XDECREF(flight->result);
+        pthread_mutex_destroy(&flight->lock);
+        pthread_cond_destroy(&flight->cond);
+        PyMem_Free(flight);
+    }
+}
+
+/* a caller's own copy of a shared result: a new tuple of new dicts */
+static PyObject *
+copy_results(PyObject *results)
+{
+    Py_ssize_t n = PyTuple_GET_SIZE(results), i;
+    PyObject *copy = PyTuple_New(n);
+
+    for (i = 0; copy && i < n; ++i) {
+        PyObject *item = PyDict_Copy(PyTuple_GET_ITEM(results, i));
+        if (!item) {
+            Py_CLEAR(copy);
+            break;
+        }
+        PyTuple_SET_ITEM(copy, i, item);
+    }
+
+    return copy;
+}
+
+/*
+ * with 'coalesce' set, a search for a file while the same search (same
+ * file, num and max_side, no where) is scanning waits for that scan and
+ * returns a copy of its result, instead of queueing for the handle lock
+ * to scan again.
+ */
+static PyObject *
+OtamaObject_search(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"num", "data", "where", "max_side", NULL};
+    PyObject *argv[4] = {NULL, NULL, NULL, NULL};
+    search_flight_t *flight, **link;
+    PyObject *result;
+    const char *path;
+    Py_ssize_t path_len;
+    int num, max_side = self->opts.max_side;
+
+    if (!self->opts.coalesce) {
+        return search_run(self, args, nargs, kwnames);
+    }
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 2, argv) < 0
+        || otamapy_arg_int(argv[0], &num) < 0
+        || otamapy_arg_max_side(argv[3], &max_side) < 0) {
+        return NULL;
+    }
+    if ((argv[2] && argv[2] != Py_None)
+        || !(PyUnicode_Check(argv[1]) || PyBytes_Check(argv[1]))) {
+        return search_run(self, args, nargs, kwnames);
+    }
+
+    if (PyUnicode_Check(argv[1])) {
+        path = PyUnicode_AsUTF8AndSize(argv[1], &path_len);
+    }
+    else if (PyBytes_AsStringAndSize(argv[1], (char **)&path, &path_len) < 0) {
+        path = NULL;
+    }
+    if (!path) {
+        return NULL;
+    }
+
+    otamapy_lock(&self->flights_lock);
+    for (flight = self->flights; flight; flight = flight->next) {
+        if (flight->num == num && flight->max_side == max_side
+            && flight->path_len == path_len
+            && memcmp(flight->path, path, path_len) == 0) {
+            flight->refs++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&self->flights_lock);
+
+    if (flight) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&flight->lock);
+        while (!flight->done) {
+            pthread_cond_wait(&flight->cond, &flight->lock);
+        }
+        pthread_mutex_unlock(&flight->lock);
+        Py_END_ALLOW_THREADS
+        result = flight->result ? copy_results(flight->result) : NULL;
+        search_flight_release(self, flight);
+        if (result || PyErr_Occurred()) {
+            return result;
+        }
+        /* the shared scan failed: scan again to raise our own error */
+        return search_run(self, args, nargs, kwnames);
+    }
+
+    if (!(flight = PyMem_Calloc(1, sizeof(search_flight_t)))
+        || !(flight->path = PyMem_Malloc(path_len ? path_len : 1))) {
+        PyMem_Free(flight);
+        return PyErr_NoMemory();
+    }
+    memcpy(flight->path, path, path_len);
+    flight->path_len = path_len;
+    flight->num = num;
+    flight->max_side = max_side;
+    flight->refs = 1;
+    pthread_mutex_init(&flight->lock, NULL);
+    pthread_cond_init(&flight->cond, NULL);
+    otamapy_lock(&self->flights_lock);
+    flight->next = self->flights;
+    self->flights = flight;
+    pthread_mutex_unlock(&self->flights_lock);
+
+    result = search_run(self, args, nargs, kwnames);
+
+    otamapy_lock(&self->flights_lock);
+    for (link = &self->flights; *link != flight; link = &(*link)->next)
+        ;
+    *link = flight->next;
+    pthread_mutex_unlock(&self->flights_lock);
+    Py_XINCREF(result);
+    flight->result = result;
+    pthread_mutex_lock(&flight->lock);
+    flight->done = 1;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flight->lock);
+    search_flight_release(self, flight);
+
+    return result;
+}
+
+static PyObject *
+OtamaObject_similarity(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"data1", "data2", "max_side", NULL};
+    PyObject *argv[3] = {NULL, NULL, NULL};
+    PyObject *data1, *data2;
+    otama_status_t ret;
+    otama_variant_pool_t *pool;
+    otama_variant_t *var1, *var2;
+    float similarity = 0.0f;
+    int max_side = self->opts.max_side;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 2, argv) < 0
+        || otamapy_arg_max_side(argv[2], &max_side) < 0) {
+        return NULL;
+    }
+
+    if (!(PyDict_Check(argv[0]) && PyDict_Check(argv[1]))) {
+        PyErr_SetString(self->state->error, "invalid argument type");
+        return NULL;
+    }
+    if (!(data1 = downscale_query(argv[0], max_side))) {
+        return NULL;
+    }
+    if (!(data2 = downscale_query(argv[1], max_side))) {
+        Py_DECREF(data1);
+        return NULL;
+    }
+
+    pool = otama_variant_pool_alloc();
+    var1 = otama_variant_new(pool);
+    var2 = otama_variant_new(pool);
+
+    otamapy_raw_rdlock();
+    if (pyobj2variant(self->state, data1, var1) < 0
+        || pyobj2variant(self->state, data2, var2) < 0) {
+        pthread_rwlock_unlock(&raw_lock);
+        Py_DECREF(data1);
+        Py_DECREF(data2);
+        otama_variant_pool_free(&pool);
+        return NULL;
+    }
+
+    OTAMAPY_CALL(self, ret, otama_similarity(self->otama, &similarity, var1, var2));
+    pthread_rwlock_unlock(&raw_lock);
+    otamapy_log_flush(self->state);
+    Py_DECREF(data1);
+    Py_DECREF(data2);
+    if (ret != OTAMA_STATUS_OK) {
+        otama_variant_pool_free(&pool);
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+    otama_variant_pool_free(&pool);
+
+    return PyFloat_FromDouble(similarity);
+}
+
+/*
+ * insert the file at path, or the encoded image in data (inserted as is,
+ * max_side applies to files). with dedup, an image whose bytes were
+ * inserted before (and whose id still exists) gets the stored id back
+ * without being decoded.
+ * @return 0 or -1 with an exception set
+ */
+static int
+insert_image(OtamaObject *self, const char *path, const Py_buffer *data,
+             int max_side, int dedup, otama_id_t *id)
+{
+    unsigned long long hash = 0;
+    otama_status_t ret = OTAMA_STATUS_OK;
+    unsigned char *scaled;
+    unsigned long scaled_size;
+    int hashed = -1, found = 0, exists = 0, err = 0;
+
+    if (!path) {
+        max_side = 0;
+    }
+    if (dedup) {
+        Py_BEGIN_ALLOW_THREADS
+        if (path) {
+            hashed = hash_file(path, &hash);
+        }
+        else {
+            hash = hash_data(data->buf, data->len);
+            hashed = 0;
+        }
+        Py_END_ALLOW_THREADS
+        if (hashed == 0) {
+            otamapy_lock(&self->attrs_lock);
+            found = dedup_find(&self->dedup, hash, max_side, id);
+            pthread_mutex_unlock(&self->attrs_lock);
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    long long t0;
+    if (found) {
+        /* entries outlive remove() */
+        pthread_mutex_lock(&self->lock);
+        ret = self->otama
+            ? otama_exists(self->otama, &exists, id)
+            : OTAMA_STATUS_INVALID_ARGUMENTS;
+        pthread_mutex_unlock(&self->lock);
+    }
+    if (ret != OTAMA_STATUS_OK || exists) {
+        /* nothing to insert */
+    }
+    else if (!path) {
+        otamapy_write_lock(self);
+        t0 = trace_begin();
+        ret = self->otama
+            ? otama_insert_data(self->otama, id, data->buf, data->len)
+            : OTAMA_STATUS_INVALID_ARGUMENTS;
+        trace_end("insert", t0);
+        pthread_mutex_unlock(&self->lock);
+    }
+    else if (downscale_jpeg(path, max_side, &scaled, &scaled_size)) {
+        otamapy_write_lock(self);
+        t0 = trace_begin();
+        ret = self->otama
+            ? otama_insert_data(self->otama, id, scaled, scaled_size)
+            : OTAMA_STATUS_INVALID_ARGUMENTS;
+        trace_end("insert", t0);
+        pthread_mutex_unlock(&self->lock);
+        free(scaled);
+    }
+    else {
+        otamapy_write_lock(self);
+        t0 = trace_begin();
+        ret = self->otama
+            ? otama_insert_file(self->otama, id, path)
+            : OTAMA_STATUS_INVALID_ARGUMENTS;
+        trace_end("insert", t0);
+        pthread_mutex_unlock(&self->lock);
+    }
+    Py_END_ALLOW_THREADS
+    otamapy_log_flush(self->state);
+
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return -1;
+    }
+    if (hashed == 0) {
+        otamapy_lock(&self->attrs_lock);
+        if (exists) {
+            self->dedup.hits++;
+        }
+        else {
+            self->dedup.misses++;
+            if (!(err = dedup_set(&self->dedup, hash, max_side, id))) {
+                dedup_append(&self->dedup, dedup_slot(&self->dedup, hash, max_side));
+            }
+        }
+        pthread_mutex_unlock(&self->attrs_lock);
+        if (err < 0) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * what insert() takes: a path as str, or bytes without NUL (as
+ * pyobj2variant() tells strings from binary), else encoded image bytes
+ * from bytes or a buffer object.
+ * @return 0 with *path set, 1 with data to PyBuffer_Release(),
+ *         or -1 with an exception set
+ */
+static int
+insert_arg(PyObject *obj, const char **path, PyObject **keep, Py_buffer *data)
+{
+    *path = NULL;
+    *keep = NULL;
+    if (PyUnicode_Check(obj)
+        || (PyBytes_Check(obj)
+            && strlen(PyBytes_AS_STRING(obj)) == (size_t)PyBytes_GET_SIZE(obj))) {
+        return (*path = pyobj2str(obj, keep)) ? 0 : -1;
+    }
+    if (!PyObject_CheckBuffer(obj)) {
+        PyErr_SetString(PyExc_TypeError, "not support type");
+        return -1;
+    }
+
+    return otamapy_get_bytes(obj, data) < 0 ? -1 : 1;
+}
+
+static PyObject *
+OtamaObject_insert(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"data", "attrs", "max_side", "dedup", NULL};
+    char hexid[OTAMA_ID_HEXSTR_LEN];
+    otama_id_t id;
+    Py_buffer view;
+    PyObject *argv[4] = {NULL, NULL, NULL, NULL};
+    PyObject *data, *attrs, *utf8_item;
+    PyObject *pyobj_id;
+    attr_kv_t *kv = NULL;
+    int nkv = 0, err, kind, dedup = 0, max_side = self->opts.max_side;
+    const char *path;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, argv) < 0
+        || otamapy_arg_max_side(argv[2], &max_side) < 0
+        || (argv[3] && (dedup = PyObject_IsTrue(argv[3])) < 0)) {
+        return NULL;
+    }
+    data = argv[0];
+    attrs = argv[1];
+
+    if (attrs == Py_None) {
+        attrs = NULL;
+    }
+    if (attrs && attr_parse(attrs, &kv, &nkv) < 0) {
+        return NULL;
+    }
+
+    if ((kind = insert_arg(data, &path, &utf8_item, &view)) < 0) {
+        attr_kv_free(kv, nkv);
+        return NULL;
+    }
+    err = insert_image(self, path, kind ? &view : NULL, max_side, dedup, &id);
+    if (kind) {
+        PyBuffer_Release(&view);
+    }
+    Py_XDECREF(utf8_item);
+    if (err < 0) {
+        attr_kv_free(kv, nkv);
+        return NULL;
+    }
+
+    otama_id_bin2hexstr(hexid, &id);
+
+    if (attrs) {
+        otamapy_lock(&self->attrs_lock);
+        err = attr_table_set(&self->attrs, &id, kv, nkv);
+        pthread_mutex_unlock(&self->attrs_lock);
+        attr_kv_free(kv, nkv);
+        if (err < 0) {
+            return PyErr_NoMemory();
+        }
+    }
+
+    pyobj_id = Py_BuildValue("s", hexid);
+    return pyobj_id;
+}
+
+/* insert() for a sequence of files or images. @return a tuple of their ids */
+static PyObject *
+OtamaObject_insert_many(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"files", "max_side", "dedup", NULL};
+    char hexid[OTAMA_ID_HEXSTR_LEN];
+    otama_id_t id;
+    Py_buffer view;
+    PyObject *argv[3] = {NULL, NULL, NULL};
+    PyObject *seq, *result_tuple, *utf8_item;
+    Py_ssize_t n, i;
+    int dedup = 0, max_side = self->opts.max_side;
+    const char *path;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, argv) < 0
+        || otamapy_arg_max_side(argv[1], &max_side) < 0
+        || (argv[2] && (dedup = PyObject_IsTrue(argv[2])) < 0)) {
+        return NULL;
+    }
+    if (!(seq = otamapy_sequence(argv[0], "files must be a sequence"))) {
+        return NULL;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (!(result_tuple = PyTuple_New(n))) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    for (i = 0; i < n; ++i) {
+        PyObject *pyobj_id;
+        int err, kind;
+
+        kind = insert_arg(PySequence_Fast_GET_ITEM(seq, i), &path, &utf8_item, &view);
+        if (kind < 0) {
+            break;
+        }
+        err = insert_image(self, path, kind ? &view : NULL, max_side, dedup, &id);
+        if (kind) {
+            PyBuffer_Release(&view);
+        }
+        Py_XDECREF(utf8_item);
+        if (err < 0) {
+            break;
+        }
+        otama_id_bin2hexstr(hexid, &id);
+        if (!(pyobj_id = PyUnicode_FromString(hexid))) {
+            break;
+        }
+        PyTuple_SET_ITEM(result_tuple, i, pyobj_id);
+    }
+    Py_DECREF(seq);
+    if (i < n) {
+        Py_DECREF(result_tuple);
+        return NULL;
+    }
+
+    return result_tuple;
+}
+
+static PyObject *
+OtamaObject_dedup_stats(OtamaObject *self)
+{
+    unsigned long hits, misses;
+    long entries;
+
+    otamapy_lock(&self->attrs_lock);
+    hits = self->dedup.hits;
+    misses = self->dedup.misses;
+    entries = self->dedup.count;
+    pthread_mutex_unlock(&self->attrs_lock);
+
+    return Py_BuildValue("{s:k,s:k,s:l}", "hits", hits, "misses", misses,
+                         "entries", entries);
+}
+
+static PyObject *
+OtamaObject_set_attributes(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"id", "attrs", NULL};
+    PyObject *argv[2];
+    PyObject *id, *attrs, *utf8_item;
+    otama_status_t ret;
+    otama_id_t otama_id;
+    const char *hexstr;
+    attr_kv_t *kv;
+    int nkv, err;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 2, argv) < 0) {
+        return NULL;
+    }
+    id = argv[0];
+    attrs = argv[1];
+
+    hexstr = pyobj2str(id, &utf8_item);
+    if (!hexstr) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "argument error");
+        }
+        return NULL;
+    }
+    ret = otama_id_hexstr2bin(&otama_id, hexstr);
+    Py_XDECREF(utf8_item);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+    if (attr_parse(attrs, &kv, &nkv) < 0) {
+        return NULL;
+    }
+
+    otamapy_lock(&self->attrs_lock);
+    err = attr_table_set(&self->attrs, &otama_id, kv, nkv);
+    pthread_mutex_unlock(&self->attrs_lock);
+    attr_kv_free(kv, nkv);
+    if (err < 0) {
+        return PyErr_NoMemory();
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+OtamaObject_remove(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"id", NULL};
+    PyObject *id;
+    const char *hexstr;
+    otama_status_t ret;
+    otama_id_t remove_id;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, &id) < 0) {
+        return NULL;
+    }
+
+    hexstr = PyUnicode_Check(id) ? PyUnicode_AsUTF8(id) : NULL;
+    if (!hexstr && PyBytes_Check(id)) {
+        hexstr = PyBytes_AS_STRING(id);
+    }
+    if (!hexstr) {
+        PyErr_SetString(PyExc_TypeError, "argument error");
+        return NULL;
+    }
+
+    ret = otama_id_hexstr2bin(&remove_id, hexstr);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    OTAMAPY_WRITE_CALL(self, ret, otama_remove(self->otama, &remove_id));
+    otamapy_log_flush(self->state);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+    otamapy_lock(&self->attrs_lock);
+    attr_table_delete(&self->attrs, &remove_id);
+    pthread_mutex_unlock(&self->attrs_lock);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+OtamaObject_exists(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"id", NULL};
+    PyObject *id;
+    const char *hexstr;
+    otama_status_t ret;
+    otama_id_t otama_id;
+    int result = 0;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, &id) < 0) {
+        return NULL;
+    }
+
+    hexstr = PyUnicode_Check(id) ? PyUnicode_AsUTF8(id) : NULL;
+    if (!hexstr && PyBytes_Check(id)) {
+        hexstr = PyBytes_AS_STRING(id);
+    }
+    if (!hexstr) {
+        PyErr_SetString(PyExc_TypeError, "argument error");
+        return NULL;
+    }
+    ret = otama_id_hexstr2bin(&otama_id, hexstr);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    OTAMAPY_CALL(self, ret, otama_exists(self->otama, &result, &otama_id));
+    otamapy_log_flush(self->state);
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    return result == 0 ? PyBool_FromLong(0) : PyBool_FromLong(1);
+}
+
+static PyObject *
+OtamaObject_invoke(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"method", "input", NULL};
+    const char *_tmp_method;
+    PyObject *argv[2];
+    PyObject *output, *method, *input;
+    otama_status_t ret;
+    otama_variant_pool_t *pool;
+    otama_variant_t *input_var, *output_var;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 2, argv) < 0) {
+        return NULL;
+    }
+    method = argv[0];
+    input = argv[1];
+    pool = otama_variant_pool_alloc();
+    input_var = otama_variant_new(pool);
+    output_var = otama_variant_new(pool);
+
+    if (PyBytes_Check(method)) {
+        _tmp_method = PyBytes_AS_STRING(method);
+    }
+    else if (PyUnicode_Check(method)) {
+        _tmp_method = PyUnicode_AsUTF8(method);
+        if (!_tmp_method) {
+            otama_variant_pool_free(&pool);
+            return NULL;
+        }
+    }
+    else {
+        otama_variant_pool_free(&pool);
+        PyErr_SetString(PyExc_TypeError, "not support type");
+        return NULL;
+    }
+
+    if (pyobj2variant(self->state, input, input_var) < 0) {
+        otama_variant_pool_free(&pool);
+        return NULL;
+    }
+
+    OTAMAPY_CALL(self, ret,
+                 otama_invoke(self->otama, _tmp_method, output_var, input_var));
+    otamapy_log_flush(self->state);
+    if (ret != OTAMA_STATUS_OK) {
+        otama_variant_pool_free(&pool);
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+
+    output = variant2pyobj(output_var);
+    otama_variant_pool_free(&pool);
+
+    return output;
+}
+
+static PyObject *
+OtamaObject_feature_raw(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"data", "max_side", NULL};
+    PyObject *argv[2] = {NULL, NULL};
+    int max_side = self->opts.max_side;
+    otama_status_t ret;
+    otama_feature_raw_t *raw;
+    PyObject *pyraw, *query;
+    otama_variant_pool_t *pool;
+    otama_variant_t *var;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, argv) < 0
+        || otamapy_arg_max_side(argv[1], &max_side) < 0) {
+        return NULL;
+    }
+
+    if (!PyDict_Check(argv[0])) {
+        PyErr_SetString(PyExc_TypeError, "invalid argument");
+        return NULL;
+    }
+    if (!(query = downscale_query(argv[0], max_side))) {
+        return NULL;
+    }
+
+    pool = otama_variant_pool_alloc();
+    var = otama_variant_new(pool);
+
+    if (pyobj2variant(self->state, query, var) < 0) {
+        Py_DECREF(query);
+        otama_variant_pool_free(&pool);
+        return NULL;
+    }
+
+    OTAMAPY_CALL(self, ret, otama_feature_raw(self->otama, &raw, var));
+    otamapy_log_flush(self->state);
+    Py_DECREF(query);
+    if (ret != OTAMA_STATUS_OK) {
+        otama_variant_pool_free(&pool);
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+    otama_variant_pool_free(&pool);
 
-        if (ret != OTAMA_STATUS_OK) {
-            otamapy_raise(ret);
-            return NULL;
+    pyraw = (PyObject *)Otama_alloc_instance(self->state->feature_raw_type);
+    if (!pyraw) {
+        otama_feature_raw_free(&raw);
+        return NULL;
+    }
+    ((OtamaFeatureRawObject *)pyraw)->raw = raw;
+
+    return pyraw;
+}
+
+static PyObject *
+OtamaObject_feature_string(OtamaObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"data", "max_side", NULL};
+    PyObject *argv[2] = {NULL, NULL};
+    int max_side = self->opts.max_side;
+    otama_status_t ret;
+    PyObject *pystr, *query;
+    otama_variant_pool_t *pool;
+    otama_variant_t *var;
+    char *feature_string = NULL;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, argv) < 0
+        || otamapy_arg_max_side(argv[1], &max_side) < 0) {
+        return NULL;
+    }
+
+    if (!PyDict_Check(argv[0])) {
+        PyErr_SetString(PyExc_TypeError, "invalid argument");
+        return NULL;
+    }
+    if (!(query = downscale_query(argv[0], max_side))) {
+        return NULL;
+    }
+
+    pool = otama_variant_pool_alloc();
+    var = otama_variant_new(pool);
+
+    if (pyobj2variant(self->state, query, var) < 0) {
+        Py_DECREF(query);
+        otama_variant_pool_free(&pool);
+        return NULL;
+    }
+
+    OTAMAPY_CALL(self, ret, otama_feature_string(self->otama, &feature_string, var));
+    otamapy_log_flush(self->state);
+    Py_DECREF(query);
+    if (ret != OTAMA_STATUS_OK) {
+        otama_variant_pool_free(&pool);
+        otamapy_raise(self->state, ret);
+        return NULL;
+    }
+    otama_variant_pool_free(&pool);
+
+    pystr = PyUnicode_FromString(feature_string);
+    // TODO: error handling
+
+    return pystr;
+}
+
+static PyObject *
+OtamaFeatureRawObject_dispose(OtamaFeatureRawObject *self)
+{
+    if (self->raw) {
+        otamapy_raw_wrlock();
+        otama_feature_raw_free(&self->raw);
+        self->raw = NULL;
+        pthread_rwlock_unlock(&raw_lock);
+    }
+
+    Py_RETURN_NONE;
+}
+
+static void
+OtamaFeatureRaw_dealloc(OtamaFeatureRawObject *self)
+{
+    if (self->raw) {
+        otamapy_raw_wrlock();
+        otama_feature_raw_free(&self->raw);
+        self->raw = NULL;
+        pthread_rwlock_unlock(&raw_lock);
+    }
+    Otama_dealloc((OtamaObject *)self);
+}
+
+/* OtamaFeatureSet */
+
+/* run under owner->lock */
+static void
+feature_set_free_raws(OtamaFeatureSetObject *self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->count; ++i) {
+        otama_feature_raw_free(&self->raws[i]);
+    }
+    free(self->raws);
+    self->raws = NULL;
+    self->count = 0;
+    self->capacity = 0;
+}
+
+/*
+ * extract the features of queries (a sequence of query dicts) and
+ * append them; one handle lock and one GIL release for all of them.
+ * @return 0 or -1 with an exception set
+ */
+static int
+feature_set_extend(OtamaFeatureSetObject *self, PyObject *queries, int max_side)
+{
+    OtamaObject *owner = self->owner;
+    otama_variant_pool_t *pool;
+    otama_variant_t **vars;
+    otama_status_t ret = OTAMA_STATUS_OK;
+    PyObject *seq, **keep;
+    Py_ssize_t n, i, done = 0;
+
+    seq = otamapy_sequence(queries, "queries must be a sequence");
+    if (!seq) {
+        return -1;
+    }
+    n = PySequence_Fast_GET_SIZE(seq);
+    keep = PyMem_Calloc(n ? n : 1, sizeof(PyObject *));
+    vars = PyMem_Calloc(n ? n : 1, sizeof(otama_variant_t *));
+    if (!keep || !vars) {
+        PyMem_Free(keep);
+        PyMem_Free(vars);
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    pool = otama_variant_pool_alloc();
+    for (i = 0; i < n; ++i) {
+        PyObject *query = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyDict_Check(query)) {
+            PyErr_SetString(PyExc_TypeError, "invalid argument");
+            goto out;
         }
+        if (!(keep[i] = downscale_query(query, max_side))) {
+            goto out;
+        }
+        vars[i] = otama_variant_new(pool);
     }
 
-    return (PyObject *)self;
+    otamapy_raw_rdlock();
+    for (i = 0; i < n; ++i) {
+        if (pyobj2variant(owner->state, keep[i], vars[i]) < 0) {
+            pthread_rwlock_unlock(&raw_lock);
+            goto out;
+        }
+    }
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&owner->lock);
+    if (!owner->otama) {
+        ret = OTAMA_STATUS_INVALID_ARGUMENTS;
+    }
+    else if (self->count + n > self->capacity) {
+        Py_ssize_t capacity = self->capacity ? self->capacity : 16;
+        otama_feature_raw_t **raws;
+        while (capacity < self->count + n) {
+            capacity *= 2;
+        }
+        raws = realloc(self->raws, sizeof(otama_feature_raw_t *) * capacity);
+        if (raws) {
+            self->raws = raws;
+            self->capacity = capacity;
+        }
+        else {
+            ret = OTAMA_STATUS_SYSERROR;
+        }
+    }
+    for (; ret == OTAMA_STATUS_OK && done < n; ++done) {
+        ret = otama_feature_raw(owner->otama, &self->raws[self->count], vars[done]);
+        if (ret == OTAMA_STATUS_OK) {
+            self->count++;
+        }
+    }
+    pthread_mutex_unlock(&owner->lock);
+    Py_END_ALLOW_THREADS
+    pthread_rwlock_unlock(&raw_lock);
+
+    if (ret != OTAMA_STATUS_OK) {
+        otamapy_raise(owner->state, ret);
+    }
+
+out:
+    otama_variant_pool_free(&pool);
+    for (i = 0; i < n; ++i) {
+        Py_XDECREF(keep[i]);
+    }
+    PyMem_Free(keep);
+    PyMem_Free(vars);
+    Py_DECREF(seq);
+
+    return PyErr_Occurred() ? -1 : 0;
 }
 
 static void
-Otama_dealloc(OtamaObject *self)
+FeatureSet_dealloc(OtamaFeatureSetObject *self)
 {
-    if (self->otama) {
-        otama_close(&(self->otama));
-        self->otama = NULL;
+    if (self->owner) {
+        /* nothing else can reach the set, but owner may be scoring
+         * against other sets, so take its lock all the same */
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->owner->lock);
+        feature_set_free_raws(self);
+        pthread_mutex_unlock(&self->owner->lock);
+        Py_END_ALLOW_THREADS
+        Py_DECREF(self->owner);
     }
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    Otama_free_instance((PyObject *)self);
 }
 
 static PyObject *
-OtamaObject_new(PyTypeObject *type, PyObject *args)
+OtamaObject_feature_set(OtamaObject *self, PyObject *const *args,
+                        Py_ssize_t nargs, PyObject *kwnames)
 {
-    PyObject *config = NULL;
-    OtamaObject *self;
+    static const char *const kwlist[] = {"queries", "max_side", NULL};
+    PyObject *argv[2] = {NULL, NULL};
+    OtamaFeatureSetObject *set;
+    int max_side = self->opts.max_side;
 
-    if (!PyArg_ParseTuple(args, "|O", &config)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 0, argv) < 0
+        || otamapy_arg_max_side(argv[1], &max_side) < 0) {
+        return NULL;
+    }
+
+    set = (OtamaFeatureSetObject *)self->state->feature_set_type->tp_alloc(
+        self->state->feature_set_type, 0);
+    if (!set) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    set->owner = self;
+
+    if (argv[0] && feature_set_extend(set, argv[0], max_side) < 0) {
+        Py_DECREF(set);
+        return NULL;
+    }
+
+    return (PyObject *)set;
+}
+
+static PyObject *
+OtamaFeatureSetObject_extend(OtamaFeatureSetObject *self, PyObject *const *args,
+                             Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"queries", "max_side", NULL};
+    PyObject *argv[2] = {NULL, NULL};
+    int max_side = self->owner->opts.max_side;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, argv) < 0
+        || otamapy_arg_max_side(argv[1], &max_side) < 0) {
+        return NULL;
+    }
+    if (feature_set_extend(self, argv[0], max_side) < 0) {
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+/* @return a tuple of the similarity of query to every feature, in order */
+static PyObject *
+OtamaFeatureSetObject_similarity(OtamaFeatureSetObject *self, PyObject *const *args,
+                                 Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"query", "max_side", NULL};
+    PyObject *argv[2] = {NULL, NULL};
+    OtamaObject *owner = self->owner;
+    int max_side = owner->opts.max_side;
+    otama_status_t ret = OTAMA_STATUS_OK;
+    otama_variant_pool_t *pool;
+    otama_variant_t *qvar, *cvar, *craw;
+    PyObject *query, *result_tuple;
+    Py_ssize_t n = 0, i;
+    float *scores = NULL;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, argv) < 0
+        || otamapy_arg_max_side(argv[1], &max_side) < 0) {
+        return NULL;
+    }
+    if (!PyDict_Check(argv[0])) {
+        PyErr_SetString(owner->state->error, "invalid argument type");
+        return NULL;
+    }
+    if (!(query = downscale_query(argv[0], max_side))) {
+        return NULL;
+    }
+
+    pool = otama_variant_pool_alloc();
+    qvar = otama_variant_new(pool);
+    cvar = otama_variant_new(pool);
+    craw = otama_variant_hash_at(cvar, "raw");
+    otamapy_raw_rdlock();
+    if (pyobj2variant(owner->state, query, qvar) < 0) {
+        pthread_rwlock_unlock(&raw_lock);
+        Py_DECREF(query);
+        otama_variant_pool_free(&pool);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&owner->lock);
+    n = self->count;
+    scores = malloc(sizeof(float) * (n ? n : 1));
+    if (!owner->otama) {
+        ret = OTAMA_STATUS_INVALID_ARGUMENTS;
+    }
+    else if (!scores) {
+        ret = OTAMA_STATUS_SYSERROR;
+    }
+    for (i = 0; ret == OTAMA_STATUS_OK && i < n; ++i) {
+        otama_variant_set_pointer(craw, self->raws[i]);
+        ret = otama_similarity(owner->otama, &scores[i], qvar, cvar);
+    }
+    pthread_mutex_unlock(&owner->lock);
+    Py_END_ALLOW_THREADS
+    pthread_rwlock_unlock(&raw_lock);
+    otama_variant_pool_free(&pool);
+    Py_DECREF(query);
+
+    if (ret != OTAMA_STATUS_OK) {
+        free(scores);
+        otamapy_raise(owner->state, ret);
+        return NULL;
+    }
+    result_tuple = PyTuple_New(n);
+    for (i = 0; result_tuple && i < n; ++i) {
+        PyTuple_SET_ITEM(result_tuple, i, PyFloat_FromDouble(scores[i]));
+    }
+    free(scores);
+
+    return result_tuple;
+}
+
+static PyObject *
+OtamaFeatureSetObject_close(OtamaFeatureSetObject *self)
+{
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->owner->lock);
+    feature_set_free_raws(self);
+    pthread_mutex_unlock(&self->owner->lock);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+OtamaFeatureSetObject_enter(OtamaFeatureSetObject *self)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+OtamaFeatureSetObject_exit(OtamaFeatureSetObject *self, PyObject *args)
+{
+    return OtamaFeatureSetObject_close(self);
+}
+
+static Py_ssize_t
+OtamaFeatureSetObject_len(OtamaFeatureSetObject *self)
+{
+    return self->count;
+}
+
+/* ShardedOtama */
+
+typedef struct {
+    otama_t *otama;
+    pthread_mutex_t *lock;
+    otamapy_state *state;           /* for otamapy_log() */
+    int shard;
+    int threads;
+    int num;
+    const char *path;               /* file query, or NULL */
+    otama_variant_pool_t *pool;     /* variant query when path is NULL */
+    otama_variant_t *var;
+    otama_result_t *results;
+    otama_status_t ret;
+    struct shard_detached *detached; /* set when the job may outlive the call */
+    int done;
+} shard_search_t;
+
+/*
+ * the jobs of a search with a timeout. they run on detached threads and
+ * may outlive the call, so the block is freed by whoever is last out.
+ * refs, started, finished, abandoned and the jobs' done are under
+ * shard_wait_lock.
+ */
+typedef struct shard_detached {
+    int refs;                   /* the caller + unfinished jobs */
+    int started;                /* jobs holding raw_lock for reading */
+    int finished;
+    int abandoned;              /* the caller has returned: skip the scan */
+    int *running;               /* the owner's count, kept up by close() */
+    char *path;
+    int njobs;
+    shard_search_t jobs[];
+} shard_detached_t;
+
+typedef struct {
+    float similarity;
+    int shard;
+    long index;
+} shard_hit_t;
+
+/* whether the timed search that job belongs to has given up on it */
+static int
+shard_abandoned(shard_search_t *job)
+{
+    int abandoned;
+
+    if (!job->detached) {
+        return 0;
+    }
+    pthread_mutex_lock(&shard_wait_lock);
+    abandoned = job->detached->abandoned;
+    pthread_mutex_unlock(&shard_wait_lock);
+
+    return abandoned;
+}
+
+static void *
+shard_search_worker(void *arg)
+{
+    shard_search_t *job = (shard_search_t *)arg;
+
+    long long t0;
+
+    pthread_mutex_lock(job->lock);
+    if (shard_abandoned(job)) {
+        /* queued behind other scans until nobody wanted the result */
+        pthread_mutex_unlock(job->lock);
+        job->ret = OTAMA_STATUS_OK;
         return NULL;
     }
+    set_scan_threads(job->threads);
+    t0 = trace_begin();
+    if (!job->otama) {
+        job->ret = OTAMA_STATUS_INVALID_ARGUMENTS;
+    }
+    else if (job->path) {
+        job->ret = otama_search_file(job->otama, &job->results, job->num, job->path);
+    }
+    else {
+        job->ret = otama_search(job->otama, &job->results, job->num, job->var);
+    }
+    trace_end("shard search", t0);
+    pthread_mutex_unlock(job->lock);
+    if (job->ret != OTAMA_STATUS_OK) {
+        otamapy_log(job->state, OTAMA_LOG_LEVEL_ERROR, "shard %d search: %s",
+                    job->shard, otama_status_message(job->ret));
+    }
+
+    return NULL;
+}
+
+static void *
+shard_pull_worker(void *arg)
+{
+    shard_search_t *job = (shard_search_t *)arg;
+
+    long long t0;
+
+    pthread_mutex_lock(job->lock);
+    t0 = trace_begin();
+    job->ret = job->otama ? otama_pull(job->otama) : OTAMA_STATUS_INVALID_ARGUMENTS;
+    trace_end("shard pull", t0);
+    pthread_mutex_unlock(job->lock);
+    if (job->ret != OTAMA_STATUS_OK) {
+        otamapy_log(job->state, OTAMA_LOG_LEVEL_ERROR, "shard %d pull: %s",
+                    job->shard, otama_status_message(job->ret));
+    }
+
+    return NULL;
+}
+
+static void
+shard_detached_free(shard_detached_t *d)
+{
+    int i;
+
+    for (i = 0; i < d->njobs; ++i) {
+        if (d->jobs[i].results) {
+            otama_result_free(&d->jobs[i].results);
+        }
+        if (d->jobs[i].pool) {
+            otama_variant_pool_free(&d->jobs[i].pool);
+        }
+    }
+    free(d->path);
+    free(d);
+}
+
+/*
+ * shard_search_worker() for a job of a shard_detached_t. takes its own
+ * raw_lock read lock, since the caller may return before the job ends.
+ */
+static void *
+shard_detached_worker(void *arg)
+{
+    shard_search_t *job = (shard_search_t *)arg;
+    shard_detached_t *d = job->detached;
+    int last;
+
+    if (!job->path) {
+        pthread_rwlock_rdlock(&raw_lock);
+    }
+    pthread_mutex_lock(&shard_wait_lock);
+    d->started++;
+    pthread_cond_broadcast(&shard_wait_cond);
+    pthread_mutex_unlock(&shard_wait_lock);
+
+    shard_search_worker(job);
+    if (!job->path) {
+        pthread_rwlock_unlock(&raw_lock);
+    }
+
+    pthread_mutex_lock(&shard_wait_lock);
+    job->done = 1;
+    d->finished++;
+    --*d->running;
+    last = --d->refs == 0;
+    pthread_cond_broadcast(&shard_wait_cond);
+    pthread_mutex_unlock(&shard_wait_lock);
+    if (last) {
+        shard_detached_free(d);
+    }
+
+    return NULL;
+}
+
+/*
+ * run worker for every job on its own thread, the last one on the caller.
+ * must be called without the GIL.
+ */
+static void
+shard_fanout(shard_search_t *jobs, int njobs, void *(*worker)(void *))
+{
+    pthread_t *threads = malloc(sizeof(pthread_t) * njobs);
+    char *started = calloc(njobs, 1);
+    int i;
+
+    for (i = 0; i < njobs - 1; ++i) {
+        if (threads && started
+            && pthread_create(&threads[i], NULL, worker, &jobs[i]) == 0) {
+            started[i] = 1;
+        }
+        else {
+            worker(&jobs[i]);
+        }
+    }
+    worker(&jobs[njobs - 1]);
+    for (i = 0; i < njobs - 1; ++i) {
+        if (started && started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    free(threads);
+    free(started);
+}
+
+static int
+shard_hit_cmp(const void *a, const void *b)
+{
+    const shard_hit_t *ha = (const shard_hit_t *)a;
+    const shard_hit_t *hb = (const shard_hit_t *)b;
+
+    if (ha->similarity != hb->similarity) {
+        return ha->similarity < hb->similarity ? 1 : -1;
+    }
+    if (ha->shard != hb->shard) {
+        return ha->shard - hb->shard;
+    }
+    return (ha->index > hb->index) - (ha->index < hb->index);
+}
+
+/*
+ * merge per-shard results into a global top num, creating Python
+ * objects only for the hits that survive.
+ */
+static PyObject *
+make_sharded_results(shard_search_t *jobs, int njobs, int num)
+{
+    PyObject *result_tuple;
+    shard_hit_t *hits;
+    long total = 0, n = 0, i;
+    int s;
 
-    self = (OtamaObject *)type->tp_alloc(type, 0);
-    if (self) {
-        if (!setup_config(self, config)) {
-            return NULL;
+    for (s = 0; s < njobs; ++s) {
+        total += otama_result_count(jobs[s].results);
+    }
+    hits = PyMem_Malloc(sizeof(shard_hit_t) * (total ? total : 1));
+    if (!hits) {
+        return PyErr_NoMemory();
+    }
+    for (s = 0; s < njobs; ++s) {
+        long count = otama_result_count(jobs[s].results);
+        for (i = 0; i < count; ++i) {
+            hits[n].similarity = result_similarity(jobs[s].results, i);
+            hits[n].shard = s;
+            hits[n].index = i;
+            ++n;
         }
     }
+    qsort(hits, n, sizeof(shard_hit_t), shard_hit_cmp);
+    if (n > num) {
+        n = num < 0 ? 0 : num;
+    }
 
-    return (PyObject *)self;
+    result_tuple = PyTuple_New(n);
+    for (i = 0; result_tuple && i < n; ++i) {
+        PyTuple_SetItem(result_tuple, i,
+                        make_result(jobs[hits[i].shard].results, hits[i].index));
+    }
+    PyMem_Free(hits);
+
+    return result_tuple;
 }
 
-static int
-OtamaObject_init(OtamaObject *self, PyObject *args)
+static void
+shard_jobs_free(shard_search_t *jobs, int njobs)
 {
-    return 0;
+    int i;
+
+    for (i = 0; i < njobs; ++i) {
+        if (jobs[i].results) {
+            otama_result_free(&jobs[i].results);
+        }
+        if (jobs[i].pool) {
+            otama_variant_pool_free(&jobs[i].pool);
+        }
+    }
+    PyMem_Free(jobs);
 }
 
-static PyObject *
-OtamaObject_open(OtamaObject *self, PyObject *args)
+static shard_search_t *
+shard_jobs_new(OtamaShardedObject *self)
 {
-    PyObject *config = NULL;
+    shard_search_t *jobs;
+    int i;
 
-    if (!PyArg_ParseTuple(args, "|O", &config)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
+    jobs = PyMem_Malloc(sizeof(shard_search_t) * self->nshards);
+    if (!jobs) {
+        PyErr_NoMemory();
         return NULL;
     }
-
-    if (!self) {
-        self = (OtamaObject *)OtamaObject_new(&OtamaObjectType, args);
-        if (!self) {
+    memset(jobs, 0, sizeof(shard_search_t) * self->nshards);
+    for (i = 0; i < self->nshards; ++i) {
+        if (!self->shards[i]) {
+            PyMem_Free(jobs);
+            PyErr_SetString(self->state->error, "not initialize/config error");
             return NULL;
         }
+        jobs[i].otama = self->shards[i];
+        jobs[i].lock = &self->locks[i];
+        jobs[i].state = self->state;
+        jobs[i].shard = i;
+        jobs[i].threads = self->opts[i].threads;
     }
 
-    return setup_config(self, config);
+    return jobs;
 }
 
-static PyObject *
-OtamaObject_close(OtamaObject *self)
+static void
+OtamaSharded_close_all(OtamaShardedObject *self)
 {
-    if (self->otama) {
-        otama_close(&self->otama);
-        self->otama = NULL;
+    int i;
+
+    /* shard jobs left behind by a timed out search still use the handles */
+    pthread_mutex_lock(&shard_wait_lock);
+    while (self->running > 0) {
+        pthread_cond_wait(&shard_wait_cond, &shard_wait_lock);
     }
+    pthread_mutex_unlock(&shard_wait_lock);
 
-    Py_RETURN_NONE;
+    for (i = 0; i < self->nshards; ++i) {
+        pthread_mutex_lock(&self->locks[i]);
+        if (self->shards[i]) {
+            otama_close(&self->shards[i]);
+            self->shards[i] = NULL;
+        }
+        pthread_mutex_unlock(&self->locks[i]);
+    }
 }
 
-static PyObject *
-OtamaObject_pull(OtamaObject *self)
+static void
+OtamaSharded_dealloc(OtamaShardedObject *self)
 {
-    otama_status_t ret;
+    int i;
 
-    ret = otama_pull(self->otama);
-    if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
-        return NULL;
+    if (self->shards) {
+        OtamaSharded_close_all(self);
+        for (i = 0; i < self->nshards; ++i) {
+            pthread_mutex_destroy(&self->locks[i]);
+        }
+        PyMem_Free(self->shards);
+        PyMem_Free(self->opts);
+        PyMem_Free(self->locks);
     }
-
-    Py_RETURN_NONE;
+    Otama_free_instance((PyObject *)self);
 }
 
 static PyObject *
-OtamaObject_create_database(OtamaObject *self)
+sharded_create(PyTypeObject *type, PyObject *configs)
 {
-    otama_status_t ret;
+    PyObject *seq;
+    OtamaShardedObject *self;
+    otamapy_state *st;
+    Py_ssize_t n, i;
 
-    if (!self->otama) {
-        PyErr_SetString(PyExc_OtamaError, "not initialize/config error");
+    seq = otamapy_sequence(configs, "configs must be a sequence");
+    if (!seq) {
         return NULL;
     }
-
-    ret = otama_create_database(self->otama);
-    if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (n < 1) {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "at least one config is required");
         return NULL;
     }
 
-    Py_RETURN_NONE;
-}
-static PyObject *
-OtamaObject_drop_database(OtamaObject *self)
-{
-    otama_status_t ret;
-
-    if (!self->otama) {
-        PyErr_SetString(PyExc_OtamaError, "not initialize/config error");
+    st = otamapy_get_state(type);
+    self = st ? (OtamaShardedObject *)type->tp_alloc(type, 0) : NULL;
+    if (!self) {
+        Py_DECREF(seq);
         return NULL;
     }
+    self->state = st;
+    self->shards = PyMem_Malloc(sizeof(otama_t *) * n);
+    self->opts = PyMem_Malloc(sizeof(open_opts_t) * n);
+    self->locks = PyMem_Malloc(sizeof(pthread_mutex_t) * n);
+    if (!self->shards || !self->opts || !self->locks) {
+        PyMem_Free(self->shards);
+        PyMem_Free(self->opts);
+        PyMem_Free(self->locks);
+        self->shards = NULL;
+        self->opts = NULL;
+        self->locks = NULL;
+        Py_DECREF(seq);
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    memset(self->shards, 0, sizeof(otama_t *) * n);
+    memset(self->opts, 0, sizeof(open_opts_t) * n);
+    for (i = 0; i < n; ++i) {
+        pthread_mutex_init(&self->locks[i], NULL);
+    }
+    self->nshards = (int)n;
 
-    ret = otama_drop_database(self->otama);
-    if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
-        return NULL;
+    for (i = 0; i < n; ++i) {
+        if (open_config(self->state, &self->shards[i],
+                        PySequence_Fast_GET_ITEM(seq, i), &self->opts[i]) < 0) {
+            Py_DECREF(seq);
+            Py_DECREF(self);
+            return NULL;
+        }
+        if (self->opts[i].max_side || self->opts[i].coalesce
+            || self->opts[i].dedup_file[0] || self->opts[i].attrs_file[0]) {
+            Py_DECREF(seq);
+            Py_DECREF(self);
+            PyErr_SetString(PyExc_ValueError,
+                            "max_side, coalesce, dedup_file and attrs_file are not supported by ShardedOtama");
+            return NULL;
+        }
     }
+    Py_DECREF(seq);
 
-    Py_RETURN_NONE;
+    return (PyObject *)self;
 }
 
 static PyObject *
-OtamaObject_create_table(OtamaObject *self)
+OtamaShardedObject_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 {
-    otama_status_t ret;
-
-    fprintf(stderr, "This API is deprecated, rename to create_database\n");
-
-    if (!self->otama) {
-        PyErr_SetString(PyExc_OtamaError, "not initialize/config error");
-        return NULL;
-    }
+    static char *kwlist[] = {"configs", NULL};
+    PyObject *configs;
 
-    ret = otama_create_database(self->otama);
-    if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &configs)) {
+        PyErr_SetString(PyExc_TypeError, "argument error");
         return NULL;
     }
 
-    Py_RETURN_NONE;
+    return sharded_create(type, configs);
 }
+
 static PyObject *
-OtamaObject_drop_table(OtamaObject *self)
+OtamaShardedObject_vectorcall(PyObject *type, PyObject *const *args,
+                              size_t nargsf, PyObject *kwnames)
 {
-    otama_status_t ret;
-
-    fprintf(stderr, "This API is deprecated, rename to drop_database\n");
-
-    if (!self->otama) {
-        PyErr_SetString(PyExc_OtamaError, "not initialize/config error");
-        return NULL;
-    }
+    static const char *const kwlist[] = {"configs", NULL};
+    PyObject *configs;
 
-    ret = otama_drop_database(self->otama);
-    if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
+    if (otamapy_unpack(args, PyVectorcall_NARGS(nargsf), kwnames,
+                       kwlist, 1, &configs) < 0) {
         return NULL;
     }
 
-    Py_RETURN_NONE;
+    return sharded_create((PyTypeObject *)type, configs);
 }
 
 static PyObject *
-OtamaObject_drop_index(OtamaObject *self)
+OtamaShardedObject_close(OtamaShardedObject *self)
 {
-    otama_status_t ret;
-
-    if (!self->otama) {
-        PyErr_SetString(PyExc_OtamaError, "not initialize/config error");
-        return NULL;
-    }
-
-    ret = otama_drop_index(self->otama);
-    if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
-        return NULL;
-    }
+    Py_BEGIN_ALLOW_THREADS
+    OtamaSharded_close_all(self);
+    Py_END_ALLOW_THREADS
 
     Py_RETURN_NONE;
 }
 
 static PyObject *
-OtamaObject_vacuum_index(OtamaObject *self)
+OtamaShardedObject_pull(OtamaShardedObject *self)
 {
-    otama_status_t ret;
+    shard_search_t *jobs;
+    otama_status_t ret = OTAMA_STATUS_OK;
+    int i;
 
-    if (!self->otama) {
-        PyErr_SetString(PyExc_OtamaError, "not initialize/config error");
+    jobs = shard_jobs_new(self);
+    if (!jobs) {
         return NULL;
     }
 
-    ret = otama_vacuum_index(self->otama);
+    Py_BEGIN_ALLOW_THREADS
+    shard_fanout(jobs, self->nshards, shard_pull_worker);
+    Py_END_ALLOW_THREADS
+    otamapy_log_flush(self->state);
+
+    for (i = 0; i < self->nshards && ret == OTAMA_STATUS_OK; ++i) {
+        ret = jobs[i].ret;
+    }
+    shard_jobs_free(jobs, self->nshards);
     if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
+        otamapy_raise(self->state, ret);
         return NULL;
     }
 
@@ -483,375 +4335,467 @@ OtamaObject_vacuum_index(OtamaObject *self)
 }
 
 static PyObject *
-OtamaObject_search(OtamaObject *self, PyObject *args)
+OtamaShardedObject_each(OtamaShardedObject *self,
+                        otama_status_t (*func)(otama_t *))
 {
-    int num;
-    otama_status_t ret;
-    otama_result_t *results = NULL;
-    otama_variant_pool_t *pool;
-    otama_variant_t *var;
-    PyObject *data;
-    PyObject *result_tuple;
-
-    if (!PyArg_ParseTuple(args, "iO", &num, &data)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
-        return NULL;
-    }
-
-    if (!self->otama) {
-        PyErr_SetString(PyExc_OtamaError, "not initialize/config error");
-        return NULL;
-    }
-
-    pool = otama_variant_pool_alloc();
-    var = otama_variant_new(pool);
-    pyobj2variant(data, var);
+    otama_status_t ret = OTAMA_STATUS_OK;
+    int i;
 
-    if (PyString_Check(data)) {
-        const char *_tmp = PyString_AsString(data);
-        char _err_tmp[120] = "not exist file ";
-        struct stat st;
-        if (stat(_tmp, &st)) {
-            otama_variant_pool_free(&pool);
-            strcat(_err_tmp, _tmp);
-            PyErr_SetString(PyExc_IOError, _err_tmp);
-            return NULL;
-        }
-        ret = otama_search_file(self->otama, &results, num, _tmp);
-    }
-    else if (PyUnicode_Check(data)) {
-        PyObject *utf8_item;
-        utf8_item = PyUnicode_AsUTF8String(data);
-        if (!utf8_item) {
-            PyErr_SetString(PyExc_OtamaError, "don't gen utf8 item");
-            return NULL;
-        }
-        const char *_tmp = PyBytes_AsString(utf8_item);
-        char _err_tmp[120] = "not exist file ";
-        struct stat st;
-        if (stat(_tmp, &st)) {
-            otama_variant_pool_free(&pool);
-            strcat(_err_tmp, _tmp);
-            PyErr_SetString(PyExc_IOError, _err_tmp);
+    for (i = 0; i < self->nshards && ret == OTAMA_STATUS_OK; ++i) {
+        if (!self->shards[i]) {
+            PyErr_SetString(self->state->error, "not initialize/config error");
             return NULL;
         }
-        ret = otama_search_file(self->otama, &results, num, _tmp);
-        Py_XDECREF(utf8_item);
-    }
-    else {
-        // TODO: not implementation
-        ret = otama_search(self->otama, &results, num, var);
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->locks[i]);
+        ret = func(self->shards[i]);
+        pthread_mutex_unlock(&self->locks[i]);
+        Py_END_ALLOW_THREADS
     }
-
     if (ret != OTAMA_STATUS_OK) {
-        otama_variant_pool_free(&pool);
-        otamapy_raise(ret);
+        otamapy_raise(self->state, ret);
         return NULL;
     }
-    result_tuple = make_results(results);
-
-    otama_result_free(&results);
-    otama_variant_pool_free(&pool);
 
-    return result_tuple;
+    Py_RETURN_NONE;
 }
 
 static PyObject *
-OtamaObject_similarity(OtamaObject *self, PyObject *args)
+OtamaShardedObject_create_database(OtamaShardedObject *self)
 {
-    PyObject *data1, *data2;
-    otama_status_t ret;
-    otama_variant_pool_t *pool;
-    otama_variant_t *var1, *var2;
-    float similarity = 0.0f;
-
-    if (!PyArg_ParseTuple(args, "OO", &data1, &data2)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
-        return NULL;
-    }
-
-    if (!(PyDict_Check(data1) && PyDict_Check(data2))) {
-        PyErr_SetString(PyExc_OtamaError, "invalid argument type");
-        return NULL;
-    }
-
-    pool = otama_variant_pool_alloc();
-    var1 = otama_variant_new(pool);
-    var2 = otama_variant_new(pool);
+    return OtamaShardedObject_each(self, otama_create_database);
+}
 
-    pyobj2variant(data1, var1);
-    pyobj2variant(data2, var2);
+static PyObject *
+OtamaShardedObject_drop_database(OtamaShardedObject *self)
+{
+    return OtamaShardedObject_each(self, otama_drop_database);
+}
 
-    ret = otama_similarity(self->otama, &similarity, var1, var2);
-    if (ret != OTAMA_STATUS_OK) {
-        otama_variant_pool_free(&pool);
-        otamapy_raise(ret);
-        return NULL;
-    }
-    otama_variant_pool_free(&pool);
+static PyObject *
+OtamaShardedObject_drop_index(OtamaShardedObject *self)
+{
+    return OtamaShardedObject_each(self, otama_drop_index);
+}
 
-    return PyFloat_FromDouble(similarity);
+static PyObject *
+OtamaShardedObject_vacuum_index(OtamaShardedObject *self)
+{
+    return OtamaShardedObject_each(self, otama_vacuum_index);
 }
 
 static PyObject *
-OtamaObject_insert(OtamaObject *self, PyObject *args)
+OtamaShardedObject_insert(OtamaShardedObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
+    static const char *const kwlist[] = {"data", NULL};
     char hexid[OTAMA_ID_HEXSTR_LEN];
     otama_id_t id;
-    otama_status_t ret;
-    otama_variant_pool_t *pool;
-    otama_variant_t *var;
-    PyObject *data;
-    PyObject *pyobj_id;
+    otama_status_t ret = OTAMA_STATUS_OK;
+    unsigned long long hash = 0;
+    PyObject *data, *utf8_item;
+    const char *path;
+    int shard, hashed;
 
-    if (!PyArg_ParseTuple(args, "O", &data)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, &data) < 0) {
         return NULL;
     }
 
-    pool = otama_variant_pool_alloc();
-    var = otama_variant_new(pool);
-    pyobj2variant(data, var);
-
-    if (PyString_Check(data)) {
-        const char *_tmp = PyString_AsString(data);
-        ret = otama_insert_file(self->otama, &id, _tmp);
+    path = pyobj2str(data, &utf8_item);
+    if (!path) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "not support type");
+        }
+        return NULL;
     }
-    else if (PyUnicode_Check(data)) {
-        PyObject *utf8_item;
-        utf8_item = PyUnicode_AsUTF8String(data);
-        if (!utf8_item) {
-            PyErr_SetString(PyExc_OtamaError, "don't gen utf8 item");
-            return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    hashed = hash_file(path, &hash);
+    if (hashed == 0) {
+        shard = (int)(hash % (unsigned long long)self->nshards);
+        pthread_mutex_lock(&self->locks[shard]);
+        if (self->shards[shard]) {
+            ret = otama_insert_file(self->shards[shard], &id, path);
         }
-        const char *_tmp = PyBytes_AsString(utf8_item);
-        ret = otama_insert_file(self->otama, &id, _tmp);
-        Py_XDECREF(utf8_item);
+        else {
+            ret = OTAMA_STATUS_INVALID_ARGUMENTS;
+        }
+        pthread_mutex_unlock(&self->locks[shard]);
     }
-    else {
-        PyErr_SetString(PyExc_TypeError, "not support type");
+    Py_END_ALLOW_THREADS
+
+    if (hashed != 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+        Py_XDECREF(utf8_item);
         return NULL;
     }
-
+    Py_XDECREF(utf8_item);
     if (ret != OTAMA_STATUS_OK) {
-        otama_variant_pool_free(&pool);
-        otamapy_raise(ret);
+        otamapy_raise(self->state, ret);
         return NULL;
     }
 
     otama_id_bin2hexstr(hexid, &id);
-    otama_variant_pool_free(&pool);
 
-    pyobj_id = Py_BuildValue("s", hexid);
-    return pyobj_id;
+    return Py_BuildValue("s", hexid);
 }
 
-static PyObject *
-OtamaObject_remove(OtamaObject *self, PyObject *args)
+static int
+sharded_parse_id(otamapy_state *st, PyObject *id, otama_id_t *otama_id)
 {
-    PyObject *id;
+    PyObject *utf8_item;
+    const char *hexstr;
     otama_status_t ret;
-    otama_id_t remove_id;
 
-    if (!PyArg_ParseTuple(args, "O", &id)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
-        return NULL;
+    hexstr = pyobj2str(id, &utf8_item);
+    if (!hexstr) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "argument error");
+        }
+        return -1;
     }
-
-    ret = otama_id_hexstr2bin(&remove_id, PyString_AsString(id));
+    ret = otama_id_hexstr2bin(otama_id, hexstr);
+    Py_XDECREF(utf8_item);
     if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
-        return NULL;
+        otamapy_raise(st, ret);
+        return -1;
     }
 
-    ret = otama_remove(self->otama, &remove_id);
-    if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
-        return NULL;
+    return 0;
+}
+
+/*
+ * the owning shard is not known from the id alone, so ask each shard.
+ * @return shard index, -1 when missing, -2 on error
+ */
+static int
+sharded_find(OtamaShardedObject *self, const otama_id_t *otama_id,
+             otama_status_t *ret)
+{
+    int i, result = 0, found = -1;
+
+    *ret = OTAMA_STATUS_OK;
+    for (i = 0; i < self->nshards && found < 0; ++i) {
+        pthread_mutex_lock(&self->locks[i]);
+        if (self->shards[i]) {
+            *ret = otama_exists(self->shards[i], &result, otama_id);
+        }
+        else {
+            *ret = OTAMA_STATUS_INVALID_ARGUMENTS;
+        }
+        pthread_mutex_unlock(&self->locks[i]);
+        if (*ret != OTAMA_STATUS_OK) {
+            return -2;
+        }
+        if (result) {
+            found = i;
+        }
     }
 
-    Py_RETURN_NONE;
+    return found;
 }
 
 static PyObject *
-OtamaObject_exists(OtamaObject *self, PyObject *args)
+OtamaShardedObject_exists(OtamaShardedObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
+    static const char *const kwlist[] = {"id", NULL};
     PyObject *id;
     otama_status_t ret;
     otama_id_t otama_id;
-    int result = 0;
-
-    if (!PyArg_ParseTuple(args, "O", &id)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
-        return NULL;
-    }
+    int shard;
 
-#ifdef PY3
-    PyObject *utf8_item;
-    utf8_item = PyUnicode_AsUTF8String(id);
-    if (!utf8_item) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
-        return NULL;
-    }
-    ret = otama_id_hexstr2bin(&otama_id, PyBytes_AsString(utf8_item));
-    Py_XDECREF(utf8_item);
-#else
-    char *hexstr = PyString_AsString(id);
-    if (!hexstr) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, &id) < 0) {
         return NULL;
     }
-    ret = otama_id_hexstr2bin(&otama_id, hexstr);
-#endif
-    if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
+    if (sharded_parse_id(self->state, id, &otama_id) < 0) {
         return NULL;
     }
 
-    ret = otama_exists(self->otama, &result, &otama_id);
-    if (ret != OTAMA_STATUS_OK) {
-        otamapy_raise(ret);
+    Py_BEGIN_ALLOW_THREADS
+    shard = sharded_find(self, &otama_id, &ret);
+    Py_END_ALLOW_THREADS
+
+    if (shard == -2) {
+        otamapy_raise(self->state, ret);
         return NULL;
     }
 
-    return result == 0 ? PyBool_FromLong(0) : PyBool_FromLong(1);
+    return PyBool_FromLong(shard >= 0);
 }
 
 static PyObject *
-OtamaObject_invoke(OtamaObject *self, PyObject *args)
+OtamaShardedObject_remove(OtamaShardedObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    const char *_tmp_method;
-    PyObject *output, *method, *input;
+    static const char *const kwlist[] = {"id", NULL};
+    PyObject *id;
     otama_status_t ret;
-    otama_variant_pool_t *pool = otama_variant_pool_alloc();
-    otama_variant_t *input_var = otama_variant_new(pool);
-    otama_variant_t *output_var = otama_variant_new(pool);
+    otama_id_t otama_id;
+    int shard;
 
-    if (!PyArg_ParseTuple(args, "OO", &method, &input)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 1, &id) < 0) {
         return NULL;
     }
-
-    if (PyString_Check(method)) {
-        _tmp_method = PyString_AsString(method);
-    }
-    else if (PyUnicode_Check(method)) {
-        PyObject *utf8_item;
-        utf8_item = PyUnicode_AsUTF8String(method);
-        if (!utf8_item) {
-            PyErr_SetString(PyExc_OtamaError, "don't gen utf8 item");
-            return NULL;
-        }
-        _tmp_method = PyBytes_AsString(utf8_item);
-        Py_XDECREF(utf8_item);
-    }
-    else {
-        PyErr_SetString(PyExc_TypeError, "not support type");
+    if (sharded_parse_id(self->state, id, &otama_id) < 0) {
         return NULL;
     }
 
-    pyobj2variant(input, input_var);
+    Py_BEGIN_ALLOW_THREADS
+    shard = sharded_find(self, &otama_id, &ret);
+    if (shard >= 0) {
+        pthread_mutex_lock(&self->locks[shard]);
+        if (self->shards[shard]) {
+            ret = otama_remove(self->shards[shard], &otama_id);
+        }
+        pthread_mutex_unlock(&self->locks[shard]);
+    }
+    Py_END_ALLOW_THREADS
 
-    ret = otama_invoke(self->otama, _tmp_method, output_var, input_var);
     if (ret != OTAMA_STATUS_OK) {
-        otama_variant_pool_free(&pool);
-        otamapy_raise(ret);
+        otamapy_raise(self->state, ret);
         return NULL;
     }
 
-    output = variant2pyobj(output_var);
-    otama_variant_pool_free(&pool);
-
-    return output;
+    Py_RETURN_NONE;
 }
 
+/*
+ * search with a deadline: wait for the shards up to seconds or until
+ * cancel(), then merge the shards that have answered.
+ * @return (results, complete)
+ */
 static PyObject *
-OtamaObject_feature_raw(OtamaObject *self, PyObject *args)
+sharded_search_until(OtamaShardedObject *self, int num, PyObject *data,
+                     const char *path, double seconds)
 {
-    otama_status_t ret;
-    otama_feature_raw_t *raw;
-    PyObject *pyraw, *query;
-    otama_variant_pool_t *pool;
-    otama_variant_t *var;
+    shard_search_t *jobs, *ready;
+    shard_detached_t *d;
+    pthread_attr_t attr;
+    struct timespec deadline;
+    otama_status_t ret = OTAMA_STATUS_OK;
+    PyObject *result_tuple = NULL;
+    unsigned long seq;
+    int n = self->nshards, nready = 0, complete, last, i;
 
-    if (!PyArg_ParseTuple(args, "O", &query)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
+    if (!(jobs = shard_jobs_new(self))) {
         return NULL;
     }
-
-    if (!PyDict_Check(query)) {
-        PyErr_SetString(PyExc_TypeError, "invalid argument");
-        return NULL;
+    d = calloc(1, sizeof(shard_detached_t) + sizeof(shard_search_t) * n);
+    ready = PyMem_Malloc(sizeof(shard_search_t) * n);
+    if (!d || !ready || (path && !(d->path = strdup(path)))) {
+        PyMem_Free(jobs);
+        PyMem_Free(ready);
+        if (d) {
+            free(d->path);
+            free(d);
+        }
+        return PyErr_NoMemory();
+    }
+    memcpy(d->jobs, jobs, sizeof(shard_search_t) * n);
+    PyMem_Free(jobs);
+    d->refs = 1;
+    d->running = &self->running;
+    d->njobs = n;
+
+    if (!path) {
+        otamapy_raw_rdlock();
+    }
+    for (i = 0; i < n; ++i) {
+        d->jobs[i].num = num;
+        d->jobs[i].path = d->path;
+        d->jobs[i].detached = d;
+        if (!path) {
+            d->jobs[i].pool = otama_variant_pool_alloc();
+            d->jobs[i].var = otama_variant_new(d->jobs[i].pool);
+            if (pyobj2variant(self->state, data, d->jobs[i].var) < 0) {
+                pthread_rwlock_unlock(&raw_lock);
+                shard_detached_free(d);
+                PyMem_Free(ready);
+                return NULL;
+            }
+        }
     }
 
-    pool = otama_variant_pool_alloc();
-    var = otama_variant_new(pool);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&shard_wait_lock);
+    seq = self->cancel_seq;
+    pthread_mutex_unlock(&shard_wait_lock);
+    for (i = 0; i < n; ++i) {
+        pthread_t thread;
+
+        pthread_mutex_lock(&shard_wait_lock);
+        d->refs++;
+        self->running++;
+        pthread_mutex_unlock(&shard_wait_lock);
+        if (pthread_create(&thread, &attr, shard_detached_worker, &d->jobs[i]) != 0) {
+            shard_detached_worker(&d->jobs[i]);
+        }
+    }
 
-    pyobj2variant(query, var);
+    pthread_mutex_lock(&shard_wait_lock);
+    /* once every job holds raw_lock itself, ours can go */
+    while (d->started < n) {
+        pthread_cond_wait(&shard_wait_cond, &shard_wait_lock);
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)seconds;
+    deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (d->finished < n && self->cancel_seq == seq) {
+        if (pthread_cond_timedwait(&shard_wait_cond, &shard_wait_lock, &deadline) != 0) {
+            break;
+        }
+    }
+    /* jobs done by now are left alone by their threads */
+    for (i = 0; i < n; ++i) {
+        if (d->jobs[i].done) {
+            ready[nready++] = d->jobs[i];
+        }
+    }
+    complete = nready == n;
+    d->abandoned = 1;           /* jobs still queued skip their scans */
+    pthread_mutex_unlock(&shard_wait_lock);
+    Py_END_ALLOW_THREADS
+    pthread_attr_destroy(&attr);
+    if (!path) {
+        pthread_rwlock_unlock(&raw_lock);
+    }
+    otamapy_log_flush(self->state);
 
-    ret = otama_feature_raw(self->otama, &raw, var);
+    for (i = 0; i < nready && ret == OTAMA_STATUS_OK; ++i) {
+        ret = ready[i].ret;
+    }
     if (ret != OTAMA_STATUS_OK) {
-        otama_variant_pool_free(&pool);
-        otamapy_raise(ret);
-        return NULL;
+        otamapy_raise(self->state, ret);
     }
-    otama_variant_pool_free(&pool);
+    else {
+        result_tuple = make_sharded_results(ready, nready, num);
+    }
+    PyMem_Free(ready);
 
-    pyraw = PyType_GenericNew(&OtamaFeatureRawObjectType, NULL, NULL);
-    ((OtamaFeatureRawObject *)pyraw)->raw = raw;
+    pthread_mutex_lock(&shard_wait_lock);
+    last = --d->refs == 0;
+    pthread_mutex_unlock(&shard_wait_lock);
+    if (last) {
+        shard_detached_free(d);
+    }
 
-    return pyraw;
+    if (!result_tuple) {
+        return NULL;
+    }
+    return Py_BuildValue("(NO)", result_tuple, complete ? Py_True : Py_False);
 }
 
 static PyObject *
-OtamaObject_feature_string(OtamaObject *self, PyObject *args)
+OtamaShardedObject_search(OtamaShardedObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    otama_status_t ret;
-    PyObject *pystr, *query;
-    otama_variant_pool_t *pool;
-    otama_variant_t *var;
-    char *feature_string = NULL;
+    static const char *const kwlist[] = {"num", "data", "timeout", NULL};
+    PyObject *argv[3] = {NULL, NULL, NULL};
+    double seconds = -1.0;
+    int num, i;
+    otama_status_t ret = OTAMA_STATUS_OK;
+    shard_search_t *jobs;
+    PyObject *data, *utf8_item;
+    PyObject *result_tuple;
+    const char *path;
 
-    if (!PyArg_ParseTuple(args, "O", &query)) {
-        PyErr_SetString(PyExc_TypeError, "argument error");
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 2, argv) < 0
+        || otamapy_arg_int(argv[0], &num) < 0) {
         return NULL;
     }
+    data = argv[1];
+    if (argv[2] && argv[2] != Py_None) {
+        seconds = PyFloat_AsDouble(argv[2]);
+        if (seconds == -1.0 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (seconds < 0.0) {
+            seconds = 0.0;
+        }
+    }
 
-    if (!PyDict_Check(query)) {
-        PyErr_SetString(PyExc_TypeError, "invalid argument");
+    path = pyobj2str(data, &utf8_item);
+    if (!path && PyErr_Occurred()) {
         return NULL;
     }
+    if (path) {
+        struct stat st;
+        if (stat(path, &st)) {
+            PyErr_Format(PyExc_IOError, "not exist file %s", path);
+            Py_XDECREF(utf8_item);
+            return NULL;
+        }
+    }
 
-    pool = otama_variant_pool_alloc();
-    var = otama_variant_new(pool);
+    if (argv[2] && argv[2] != Py_None) {
+        result_tuple = sharded_search_until(self, num, data, path, seconds);
+        Py_XDECREF(utf8_item);
+        return result_tuple;
+    }
+
+    jobs = shard_jobs_new(self);
+    if (!jobs) {
+        Py_XDECREF(utf8_item);
+        return NULL;
+    }
+    if (!path) {
+        otamapy_raw_rdlock();
+    }
+    for (i = 0; i < self->nshards; ++i) {
+        jobs[i].num = num;
+        jobs[i].path = path;
+        if (!path) {
+            /* one variant per shard: lookups may touch the hash */
+            jobs[i].pool = otama_variant_pool_alloc();
+            jobs[i].var = otama_variant_new(jobs[i].pool);
+            if (pyobj2variant(self->state, data, jobs[i].var) < 0) {
+                pthread_rwlock_unlock(&raw_lock);
+                shard_jobs_free(jobs, self->nshards);
+                Py_XDECREF(utf8_item);
+                return NULL;
+            }
+        }
+    }
 
-    pyobj2variant(query, var);
+    Py_BEGIN_ALLOW_THREADS
+    shard_fanout(jobs, self->nshards, shard_search_worker);
+    Py_END_ALLOW_THREADS
+    if (!path) {
+        pthread_rwlock_unlock(&raw_lock);
+    }
+    otamapy_log_flush(self->state);
+    Py_XDECREF(utf8_item);
 
-    ret = otama_feature_string(self->otama, &feature_string, var);
+    for (i = 0; i < self->nshards && ret == OTAMA_STATUS_OK; ++i) {
+        ret = jobs[i].ret;
+    }
     if (ret != OTAMA_STATUS_OK) {
-        otama_variant_pool_free(&pool);
-        otamapy_raise(ret);
+        shard_jobs_free(jobs, self->nshards);
+        otamapy_raise(self->state, ret);
         return NULL;
     }
-    otama_variant_pool_free(&pool);
-
-    pystr = PyString_FromString(feature_string);
-    // TODO: error handling
+    result_tuple = make_sharded_results(jobs, self->nshards, num);
+    shard_jobs_free(jobs, self->nshards);
 
-    return pystr;
+    return result_tuple;
 }
 
 static PyObject *
-OtamaFeatureRawObject_dispose(OtamaFeatureRawObject *self)
+OtamaShardedObject_cancel(OtamaShardedObject *self)
 {
-    otama_feature_raw_free(&self->raw);
-    self->raw = NULL;
+    pthread_mutex_lock(&shard_wait_lock);
+    self->cancel_seq++;
+    pthread_cond_broadcast(&shard_wait_cond);
+    pthread_mutex_unlock(&shard_wait_lock);
 
     Py_RETURN_NONE;
 }
 
 static PyMethodDef OtamaObject_methods[] = {
-    {"open", (PyCFunction)OtamaObject_open, METH_VARARGS|METH_STATIC,
+    {"open", (PyCFunction)OtamaObject_open, METH_FASTCALL|METH_KEYWORDS|METH_CLASS,
      "open Otama"},
     {"close", (PyCFunction)OtamaObject_close, METH_NOARGS,
      "close Otama Object"},
@@ -865,78 +4809,64 @@ static PyMethodDef OtamaObject_methods[] = {
      "create Otama Database Table (deprecated)"},
     {"drop_table", (PyCFunction)OtamaObject_drop_table, METH_NOARGS,
      "drop to Otama Database Table (deprecated)"},
-    {"drop_index", (PyCFunction)OtamaObject_drop_index, METH_NOARGS,
-     "drop to Otama Database Index"},
-    {"vacuum_index", (PyCFunction)OtamaObject_vacuum_index, METH_NOARGS,
-     "vacuum to Otama Database Index"},
-    {"insert", (PyCFunction)OtamaObject_insert, METH_VARARGS,
-     "insert image data"},
-    {"remove", (PyCFunction)OtamaObject_remove, METH_VARARGS,
+    {"drop_index", (PyCFunction)OtamaObject_drop_index, METH_FASTCALL|METH_KEYWORDS,
+     "drop to Otama Database Index (background=True returns an OtamaIndexJob)"},
+    {"vacuum_index", (PyCFunction)OtamaObject_vacuum_index, METH_FASTCALL|METH_KEYWORDS,
+     "vacuum to Otama Database Index (background=True returns an OtamaIndexJob)"},
+    {"insert", (PyCFunction)OtamaObject_insert, METH_FASTCALL|METH_KEYWORDS,
+     "insert image data, with optional integer attributes"},
+    {"set_attributes", (PyCFunction)OtamaObject_set_attributes, METH_FASTCALL|METH_KEYWORDS,
+     "attach integer attributes to id for search(where=...)"},
+    {"remove", (PyCFunction)OtamaObject_remove, METH_FASTCALL|METH_KEYWORDS,
      "remove id from Otama Database"},
-    {"search", (PyCFunction)OtamaObject_search, METH_VARARGS,
-     "search from Otama Database"},
-    {"similarity", (PyCFunction)OtamaObject_similarity, METH_VARARGS,
+    {"search", (PyCFunction)OtamaObject_search, METH_FASTCALL|METH_KEYWORDS,
+     "search from Otama Database, keeping only hits matching where"},
+    {"similarity", (PyCFunction)OtamaObject_similarity, METH_FASTCALL|METH_KEYWORDS,
      "check similarity"},
-    {"exists", (PyCFunction)OtamaObject_exists, METH_VARARGS,
+    {"exists", (PyCFunction)OtamaObject_exists, METH_FASTCALL|METH_KEYWORDS,
      "exist image in Otama Database"},
-    {"feature_string", (PyCFunction)OtamaObject_feature_string, METH_VARARGS,
+    {"feature_string", (PyCFunction)OtamaObject_feature_string, METH_FASTCALL|METH_KEYWORDS,
      "return feature string value"},
-    {"feature_raw", (PyCFunction)OtamaObject_feature_raw, METH_VARARGS,
+    {"insert_many", (PyCFunction)OtamaObject_insert_many, METH_FASTCALL|METH_KEYWORDS,
+     "insert a sequence of files or image data, return their ids"},
+    {"dedup_stats", (PyCFunction)OtamaObject_dedup_stats, METH_NOARGS,
+     "hits, misses and entries of the dedup index"},
+    {"feature_raw", (PyCFunction)OtamaObject_feature_raw, METH_FASTCALL|METH_KEYWORDS,
      "return feature raw value"},
-    {"invoke", (PyCFunction)OtamaObject_invoke, METH_VARARGS,
+    {"feature_set", (PyCFunction)OtamaObject_feature_set, METH_FASTCALL|METH_KEYWORDS,
+     "return the features of a sequence of queries as one OtamaFeatureSet"},
+    {"invoke", (PyCFunction)OtamaObject_invoke, METH_FASTCALL|METH_KEYWORDS,
      "invoke Database driver"},
     {NULL, NULL, 0, NULL}
 };
 
 static PyMemberDef OtamaObject_members[] = {
+    {"threads", T_INT, offsetof(OtamaObject, opts.threads), READONLY,
+     "scan threads per search (0: library default)"},
+    {"max_side", T_INT, offsetof(OtamaObject, opts.max_side), READONLY,
+     "JPEG decode target of the longer side (0: full resolution)"},
+    {"coalesce", T_INT, offsetof(OtamaObject, opts.coalesce), READONLY,
+     "share the scan of identical concurrent searches"},
     {NULL}
 };
 
 
-static PyTypeObject OtamaObjectType = {
-#ifdef PY3
-    PyVarObject_HEAD_INIT(NULL, 0)
-#else
-    PyObject_HEAD_INIT(NULL)
-    0,                                          /* ob_size */
-#endif
-    "otama.Otama",                              /* tp_name */
-    sizeof(OtamaObject),                        /* tp_basicsize */
-    0,
-    (destructor)Otama_dealloc,                  /* tp_dealloc */
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
-    "Otama objects",                            /* tp_doc */
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    OtamaObject_methods,                        /* tp_methods */
-    OtamaObject_members,                        /* tp_members */
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    (initproc)OtamaObject_init,                 /* tp_init */
-    0,                                          /* tp_alloc */
-    (newfunc)OtamaObject_new,                   /* tp_new */
+static PyType_Slot OtamaObject_slots[] = {
+    {Py_tp_dealloc, Otama_dealloc},
+    {Py_tp_doc, "Otama objects"},
+    {Py_tp_methods, OtamaObject_methods},
+    {Py_tp_members, OtamaObject_members},
+    {Py_tp_init, OtamaObject_init},
+    {Py_tp_new, OtamaObject_new},
+    {0, NULL}
+};
+
+static PyType_Spec OtamaObject_spec = {
+    "otama.Otama",                              /* name */
+    sizeof(OtamaObject),                        /* basicsize */
+    0,                                          /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* flags */
+    OtamaObject_slots,                          /* slots */
 };
 
 static PyMethodDef OtamaFeatureRawObject_methods[] = {
@@ -949,111 +4879,453 @@ static PyMemberDef OtamaFeatureRawObject_members[] = {
     {NULL}
 };
 
-static PyTypeObject OtamaFeatureRawObjectType = {
-#ifdef PY3
-    PyVarObject_HEAD_INIT(NULL, 0)
-#else
-    PyObject_HEAD_INIT(NULL)
-    0,                                          /* ob_size */
-#endif
-    "otama.OtamaFeatureRaw",                    /* tp_name */
-    sizeof(OtamaFeatureRawObject),              /* tp_basicsize */
-    0,
-    (destructor)Otama_dealloc,                  /* tp_dealloc */
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
-    "OtamaFeatureRaw objects",                  /* tp_doc */
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    OtamaFeatureRawObject_methods,              /* tp_methods */
-    OtamaFeatureRawObject_members,              /* tp_members */
-    0,
-    0,
-    0,
-    0,
-    0,
-    0,
-    (initproc)OtamaObject_init,                 /* tp_init */
-    0,                                          /* tp_alloc */
-    (newfunc)OtamaObject_new,                   /* tp_new */
+static PyMethodDef OtamaFeatureSetObject_methods[] = {
+    {"extend", (PyCFunction)OtamaFeatureSetObject_extend, METH_FASTCALL|METH_KEYWORDS,
+     "extract and append the features of a sequence of queries"},
+    {"similarity", (PyCFunction)OtamaFeatureSetObject_similarity, METH_FASTCALL|METH_KEYWORDS,
+     "similarity of a query to every feature in the set"},
+    {"close", (PyCFunction)OtamaFeatureSetObject_close, METH_NOARGS,
+     "free all features"},
+    {"__enter__", (PyCFunction)OtamaFeatureSetObject_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)OtamaFeatureSetObject_exit, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
 };
 
-static PyMethodDef OtamaMethods[] = {
+static PyType_Slot OtamaFeatureRawObject_slots[] = {
+    {Py_tp_dealloc, OtamaFeatureRaw_dealloc},
+    {Py_tp_doc, "OtamaFeatureRaw objects"},
+    {Py_tp_methods, OtamaFeatureRawObject_methods},
+    {Py_tp_members, OtamaFeatureRawObject_members},
+    {Py_tp_init, OtamaObject_init},
+    {Py_tp_new, OtamaObject_new},
+    {0, NULL}
+};
+
+static PyType_Spec OtamaFeatureRawObject_spec = {
+    "otama.OtamaFeatureRaw",                    /* name */
+    sizeof(OtamaFeatureRawObject),              /* basicsize */
+    0,                                          /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* flags */
+    OtamaFeatureRawObject_slots,                /* slots */
+};
+
+static PyMethodDef OtamaShardedObject_methods[] = {
+    {"close", (PyCFunction)OtamaShardedObject_close, METH_NOARGS,
+     "close all shards"},
+    {"pull", (PyCFunction)OtamaShardedObject_pull, METH_NOARGS,
+     "pull every shard in parallel"},
+    {"create_database", (PyCFunction)OtamaShardedObject_create_database, METH_NOARGS,
+     "create Otama Database Table on every shard"},
+    {"drop_database", (PyCFunction)OtamaShardedObject_drop_database, METH_NOARGS,
+     "drop Otama Database Table on every shard"},
+    {"drop_index", (PyCFunction)OtamaShardedObject_drop_index, METH_NOARGS,
+     "drop Otama Database Index on every shard"},
+    {"vacuum_index", (PyCFunction)OtamaShardedObject_vacuum_index, METH_NOARGS,
+     "vacuum Otama Database Index on every shard"},
+    {"insert", (PyCFunction)OtamaShardedObject_insert, METH_FASTCALL|METH_KEYWORDS,
+     "insert image file into the shard chosen by its content hash"},
+    {"remove", (PyCFunction)OtamaShardedObject_remove, METH_FASTCALL|METH_KEYWORDS,
+     "remove id from the shard holding it"},
+    {"exists", (PyCFunction)OtamaShardedObject_exists, METH_FASTCALL|METH_KEYWORDS,
+     "exist image in any shard"},
+    {"search", (PyCFunction)OtamaShardedObject_search, METH_FASTCALL|METH_KEYWORDS,
+     "search all shards in parallel and merge the top results; "
+     "with a timeout (not None), return (results, complete) by then"},
+    {"cancel", (PyCFunction)OtamaShardedObject_cancel, METH_NOARGS,
+     "make searches waiting with a timeout return what they have"},
     {NULL, NULL, 0, NULL}
 };
 
-static char OtamaDoc[] = "otama Python Interface.\n";
+static PyMemberDef OtamaShardedObject_members[] = {
+    {"shards", T_INT, offsetof(OtamaShardedObject, nshards), READONLY,
+     "number of shards"},
+    {NULL}
+};
 
+static PyType_Slot OtamaShardedObject_slots[] = {
+    {Py_tp_dealloc, OtamaSharded_dealloc},
+    {Py_tp_doc, "ShardedOtama objects"},
+    {Py_tp_methods, OtamaShardedObject_methods},
+    {Py_tp_members, OtamaShardedObject_members},
+    {Py_tp_init, OtamaObject_init},
+    {Py_tp_new, OtamaShardedObject_new},
+    {0, NULL}
+};
 
-#ifdef PY3
-static struct PyModuleDef OtamaModuleDef = {
-    PyModuleDef_HEAD_INIT,
-    "otamapy",
-    OtamaDoc,
-    -1,
-    OtamaMethods,
+static PyType_Spec OtamaShardedObject_spec = {
+    "otama.ShardedOtama",                       /* name */
+    sizeof(OtamaShardedObject),                 /* basicsize */
+    0,                                          /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* flags */
+    OtamaShardedObject_slots,                   /* slots */
 };
 
-PyMODINIT_FUNC
-PyInit_otama(void)
+static PyMethodDef OtamaIndexJobObject_methods[] = {
+    {"done", (PyCFunction)OtamaIndexJobObject_done, METH_NOARGS,
+     "True when the job has finished"},
+    {"wait", (PyCFunction)OtamaIndexJobObject_wait, METH_FASTCALL|METH_KEYWORDS,
+     "wait for the job, up to timeout seconds; True when finished"},
+    {"cancel", (PyCFunction)OtamaIndexJobObject_cancel, METH_NOARGS,
+     "skip swapping in the rebuilt index; False when too late"},
+    {NULL, NULL, 0, NULL}
+};
 
-#else
+static PyGetSetDef OtamaIndexJobObject_getset[] = {
+    {"state", (getter)OtamaIndexJobObject_get_state, NULL,
+     "running, swapping, done, cancelled or failed", NULL},
+    {NULL}
+};
 
-PyMODINIT_FUNC
-initotama(void)
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+#define Py_TPFLAGS_DISALLOW_INSTANTIATION 0
 #endif
+
+static PyType_Slot OtamaIndexJobObject_slots[] = {
+    {Py_tp_dealloc, IndexJob_dealloc},
+    {Py_tp_doc, "OtamaIndexJob objects"},
+    {Py_tp_methods, OtamaIndexJobObject_methods},
+    {Py_tp_getset, OtamaIndexJobObject_getset},
+    {0, NULL}
+};
+
+static PyType_Spec OtamaIndexJobObject_spec = {
+    "otama.OtamaIndexJob",                      /* name */
+    sizeof(OtamaIndexJobObject),                /* basicsize */
+    0,                                          /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /* flags */
+    OtamaIndexJobObject_slots,                  /* slots */
+};
+
+static PyType_Slot OtamaFeatureSetObject_slots[] = {
+    {Py_tp_dealloc, FeatureSet_dealloc},
+    {Py_tp_doc, "OtamaFeatureSet objects"},
+    {Py_tp_methods, OtamaFeatureSetObject_methods},
+    {Py_sq_length, OtamaFeatureSetObject_len},
+    {0, NULL}
+};
+
+static PyType_Spec OtamaFeatureSetObject_spec = {
+    "otama.OtamaFeatureSet",                    /* name */
+    sizeof(OtamaFeatureSetObject),              /* basicsize */
+    0,                                          /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /* flags */
+    OtamaFeatureSetObject_slots,                /* slots */
+};
+
+static PyObject *
+otama_set_log_level(PyObject *module, PyObject *arg)
 {
-    PyObject *module;
+    otamapy_state *st = (otamapy_state *)PyModule_GetState(module);
+    long level = PyLong_AsLong(arg);
 
-#ifdef PY3
-    module = PyModule_Create(&OtamaModuleDef);
-#else
-    module = Py_InitModule3("otama", OtamaMethods, OtamaDoc);
-    if (!module)
-        return;
-#endif
+    if (level == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (level < OTAMA_LOG_LEVEL_DEBUG || level > OTAMA_LOG_LEVEL_QUIET) {
+        PyErr_SetString(PyExc_ValueError, "unknown log level");
+        return NULL;
+    }
+    pthread_mutex_lock(&log_level_lock);
+    otama_log_set_level((otama_log_level_e)level);
+    log_level_set = 1;
+    pthread_mutex_unlock(&log_level_lock);
+    st->log.level = (int)level;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+otama_get_log_level(PyObject *module, PyObject *unused)
+{
+    otamapy_state *st = (otamapy_state *)PyModule_GetState(module);
+
+    return PyLong_FromLong(st->log.level);
+}
+
+static PyObject *
+otama_set_log_sink(PyObject *module, PyObject *sink)
+{
+    otamapy_state *st = (otamapy_state *)PyModule_GetState(module);
+    PyObject *old;
+
+    if (sink != Py_None && !PyCallable_Check(sink)) {
+        PyErr_SetString(PyExc_TypeError, "log sink must be callable or None");
+        return NULL;
+    }
+    if (sink == Py_None) {
+        sink = NULL;
+    }
+    Py_XINCREF(sink);
+    pthread_mutex_lock(&st->log.lock);
+    old = st->log_sink;
+    st->log_sink = sink;
+    pthread_mutex_unlock(&st->log.lock);
+    Py_XDECREF(old);
+    otamapy_log_flush(st);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+otama_flush_log(PyObject *module, PyObject *unused)
+{
+    otamapy_log_flush((otamapy_state *)PyModule_GetState(module));
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+otama_trace_start(PyObject *module, PyObject *const *args, Py_ssize_t nargs,
+                  PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"capacity", NULL};
+    PyObject *argv[1] = {NULL};
+    trace_event_t *events;
+    int capacity = 65536;
+
+    if (otamapy_unpack(args, nargs, kwnames, kwlist, 0, argv) < 0
+        || (argv[0] && otamapy_arg_int(argv[0], &capacity) < 0)) {
+        return NULL;
+    }
+    if (capacity < 1) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be >= 1");
+        return NULL;
+    }
+    events = malloc(sizeof(trace_event_t) * capacity);
+    if (!events) {
+        return PyErr_NoMemory();
+    }
+
+    pthread_mutex_lock(&trace.lock);
+    free(trace.events);
+    trace.events = events;
+    trace.capacity = capacity;
+    trace.count = 0;
+    trace.dropped = 0;
+    trace.enabled = 1;
+    pthread_mutex_unlock(&trace.lock);
+
+    Py_RETURN_NONE;
+}
+
+/* @return the spans since trace_start() as Chrome trace events */
+static PyObject *
+otama_trace_stop(PyObject *module, PyObject *unused)
+{
+    trace_event_t *events;
+    size_t count, dropped, i;
+    PyObject *list;
+    long pid = (long)getpid();
+
+    pthread_mutex_lock(&trace.lock);
+    trace.enabled = 0;
+    events = trace.events;
+    count = trace.count;
+    dropped = trace.dropped;
+    trace.events = NULL;
+    trace.capacity = 0;
+    trace.count = 0;
+    trace.dropped = 0;
+    pthread_mutex_unlock(&trace.lock);
+
+    list = PyList_New(0);
+    for (i = 0; list && i < count; ++i) {
+        PyObject *ev = Py_BuildValue("{s:s,s:s,s:d,s:d,s:l,s:l}",
+                                     "name", events[i].name,
+                                     "ph", "X",
+                                     "ts", events[i].start / 1e3,
+                                     "dur", events[i].duration / 1e3,
+                                     "pid", pid,
+                                     "tid", events[i].tid);
+        if (!ev || PyList_Append(list, ev) < 0) {
+            Py_CLEAR(list);
+        }
+        Py_XDECREF(ev);
+    }
+    free(events);
+    if (list && dropped) {
+        otamapy_log((otamapy_state *)PyModule_GetState(module), OTAMA_LOG_LEVEL_NOTICE,
+                    "trace buffer full, %zu spans dropped", dropped);
+    }
+
+    return list;
+}
+
+static PyMethodDef OtamaMethods[] = {
+    {"set_log_level", (PyCFunction)otama_set_log_level, METH_O,
+     "set the log level of libotama and otamapy (LOG_LEVEL_*)"},
+    {"get_log_level", (PyCFunction)otama_get_log_level, METH_NOARGS,
+     "return the log level"},
+    {"set_log_sink", (PyCFunction)otama_set_log_sink, METH_O,
+     "call sink with batches of (level, time, message), None to stop"},
+    {"flush_log", (PyCFunction)otama_flush_log, METH_NOARGS,
+     "hand pending log records to the log sink now"},
+    {"trace_start", (PyCFunction)otama_trace_start, METH_FASTCALL|METH_KEYWORDS,
+     "record open/pull/search/insert spans, at most capacity"},
+    {"trace_stop", (PyCFunction)otama_trace_stop, METH_NOARGS,
+     "stop tracing, return the spans as Chrome trace events"},
+    {NULL, NULL, 0, NULL}
+};
+
+static char OtamaDoc[] = "otama Python Interface.\n";
+
+static PyTypeObject *
+otamapy_add_type(PyObject *module, PyType_Spec *spec)
+{
+    PyTypeObject *type;
+
+    type = (PyTypeObject *)PyType_FromModuleAndSpec(module, spec, NULL);
+    if (!type) {
+        return NULL;
+    }
+    if (PyModule_AddType(module, type) < 0) {
+        Py_DECREF(type);
+        return NULL;
+    }
+
+    return type;
+}
+
+static int
+otama_exec(PyObject *module)
+{
+    otamapy_state *st = (otamapy_state *)PyModule_GetState(module);
+
+    pthread_mutex_init(&st->log.lock, NULL);
+    st->log.ready = 1;
+    st->log.level = OTAMA_LOG_LEVEL_ERROR;
 
     if (PyModule_AddStringConstant(module,
                                    "__libotama_version__",
                                    otama_version_string()) < 0)
-        OTAMAPY_INIT_ERROR;
+        return -1;
+
+    st->error = PyErr_NewException("otama.OtamaError", NULL, NULL);
+    if (!st->error)
+        return -1;
+
+    Py_INCREF(st->error);
+    if (PyModule_AddObject(module, "OtamaError", st->error) < 0) {
+        Py_DECREF(st->error);
+        return -1;
+    }
+
+    Py_INCREF(st->error);
+    if (PyModule_AddObject(module, "error", st->error) < 0) {
+        Py_DECREF(st->error);
+        return -1;
+    }
+
+    if (!(st->otama_type = otamapy_add_type(module, &OtamaObject_spec)))
+        return -1;
+    /* not inherited, so subclasses (which may define __init__) keep
+     * going through tp_new and tp_init */
+    st->otama_type->tp_vectorcall = OtamaObject_vectorcall;
+
+    if (!(st->feature_raw_type = otamapy_add_type(module, &OtamaFeatureRawObject_spec)))
+        return -1;
+
+    if (!(st->sharded_type = otamapy_add_type(module, &OtamaShardedObject_spec)))
+        return -1;
+    st->sharded_type->tp_vectorcall = OtamaShardedObject_vectorcall;
+
+    if (!(st->index_job_type = otamapy_add_type(module, &OtamaIndexJobObject_spec)))
+        return -1;
+
+    if (!(st->feature_set_type = otamapy_add_type(module, &OtamaFeatureSetObject_spec)))
+        return -1;
+#if PY_VERSION_HEX < 0x030A0000
+    st->index_job_type->tp_new = NULL;
+    st->feature_set_type->tp_new = NULL;
+#endif
+
+    if (PyModule_AddIntConstant(module, "LOG_LEVEL_DEBUG", OTAMA_LOG_LEVEL_DEBUG) < 0
+        || PyModule_AddIntConstant(module, "LOG_LEVEL_NOTICE", OTAMA_LOG_LEVEL_NOTICE) < 0
+        || PyModule_AddIntConstant(module, "LOG_LEVEL_ERROR", OTAMA_LOG_LEVEL_ERROR) < 0
+        || PyModule_AddIntConstant(module, "LOG_LEVEL_QUIET", OTAMA_LOG_LEVEL_QUIET) < 0)
+        return -1;
 
-    if (PyType_Ready(&OtamaObjectType) < 0)
-        OTAMAPY_INIT_ERROR;
+    /* the default, unless a (sub)interpreter already chose one */
+    pthread_mutex_lock(&log_level_lock);
+    if (!log_level_set) {
+        otama_log_set_level(OTAMA_LOG_LEVEL_ERROR);
+    }
+    pthread_mutex_unlock(&log_level_lock);
+#ifdef _OPENMP
+    pthread_once(&default_scan_threads_once, save_default_scan_threads);
+#endif
+
+    return 0;
+}
+
+static int
+otama_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    otamapy_state *st = (otamapy_state *)PyModule_GetState(module);
 
-    if (PyType_Ready(&OtamaFeatureRawObjectType) < 0)
-        OTAMAPY_INIT_ERROR;
+    Py_VISIT(st->error);
+    Py_VISIT(st->otama_type);
+    Py_VISIT(st->feature_raw_type);
+    Py_VISIT(st->sharded_type);
+    Py_VISIT(st->index_job_type);
+    Py_VISIT(st->feature_set_type);
+    Py_VISIT(st->log_sink);
 
-    PyExc_OtamaError = PyErr_NewException("otama.OtamaError", NULL, NULL);
+    return 0;
+}
+
+static int
+otama_clear(PyObject *module)
+{
+    otamapy_state *st = (otamapy_state *)PyModule_GetState(module);
+
+    Py_CLEAR(st->error);
+    Py_CLEAR(st->otama_type);
+    Py_CLEAR(st->feature_raw_type);
+    Py_CLEAR(st->sharded_type);
+    Py_CLEAR(st->index_job_type);
+    Py_CLEAR(st->feature_set_type);
+    Py_CLEAR(st->log_sink);
 
-    Py_INCREF(&OtamaObjectType);
-    PyModule_AddObject(module, "Otama", (PyObject *)&OtamaObjectType);
+    return 0;
+}
 
-    Py_INCREF(&OtamaFeatureRawObjectType);
-    PyModule_AddObject(module, "OtamaFeatureRaw", (PyObject *)&OtamaFeatureRawObjectType);
+static void
+otama_free(void *module)
+{
+    otamapy_state *st = (otamapy_state *)PyModule_GetState((PyObject *)module);
 
-    Py_INCREF(PyExc_OtamaError);
-    PyModule_AddObject(module, "error", (PyObject *)&OtamaObjectType);
+    otama_clear((PyObject *)module);
+    if (st->log.ready) {
+        pthread_mutex_destroy(&st->log.lock);
+    }
+}
 
-    otama_log_set_level(OTAMA_LOG_LEVEL_ERROR);
-#ifdef PY3
-    return module;
+static PyModuleDef_Slot OtamaModuleSlots[] = {
+    {Py_mod_exec, otama_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
 #endif
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
+static struct PyModuleDef OtamaModuleDef = {
+    PyModuleDef_HEAD_INIT,
+    "otama",
+    OtamaDoc,
+    sizeof(otamapy_state),
+    OtamaMethods,
+    OtamaModuleSlots,
+    otama_traverse,
+    otama_clear,
+    otama_free,
+};
+
+PyMODINIT_FUNC
+PyInit_otama(void)
+{
+    return PyModuleDef_Init(&OtamaModuleDef);
 }
@@ -1,14 +1,50 @@
 try:
     from setuptools import setup, Extension
+    from setuptools.command.build_ext import build_ext
 except ImportError:
     from distutils.core import setup, Extension
+    from distutils.command.build_ext import build_ext
+from distutils.errors import CompileError, LinkError
 from distutils.sysconfig import get_python_inc
 import os
+import shutil
+import tempfile
 
 include_dirs = [get_python_inc()]
 library_dirs = ['/usr/local/lib']
 exec(open('otama/_version.py').read())
 
+
+def has_openmp(compiler):
+    """whether compiler builds and links with -fopenmp (Apple clang does not)"""
+    tmpdir = tempfile.mkdtemp()
+    try:
+        src = os.path.join(tmpdir, 'openmp.c')
+        with open(src, 'w') as f:
+            f.write('#include <omp.h>\n'
+                    'int main(void) { return omp_get_max_threads() < 1; }\n')
+        objects = compiler.compile([src], output_dir=tmpdir,
+                                   extra_postargs=['-fopenmp'])
+        compiler.link_executable(objects, os.path.join(tmpdir, 'openmp'),
+                                 extra_postargs=['-fopenmp'])
+    except (CompileError, LinkError):
+        return False
+    finally:
+        shutil.rmtree(tmpdir)
+    return True
+
+
+class build_openmp_ext(build_ext):
+    """build_ext adding -fopenmp where the compiler takes it"""
+
+    def build_extensions(self):
+        if has_openmp(self.compiler):
+            for ext in self.extensions:
+                ext.extra_compile_args.append('-fopenmp')
+                ext.extra_link_args.append('-fopenmp')
+        build_ext.build_extensions(self)
+
+
 setup(name='otamapy',
       version=__version__,
       description="otamapy is Python Interface for otama.",
@@ -19,12 +55,13 @@ setup(name='otamapy',
       license='GPLv3',
       platforms='Linux',
       packages=['otama'],
+      cmdclass={'build_ext': build_openmp_ext},
       ext_modules=[
           Extension('otama.otama',
                     sources=['./otama/otama.c'],
                     include_dirs=include_dirs,
                     library_dirs=library_dirs,
-                    libraries=['otama'],
+                    libraries=['otama', 'jpeg', 'pthread'],
                     #extra_compile_args=["-DDEBUG"],
                     )],
       classifiers=[
@@ -33,8 +70,9 @@ setup(name='otamapy',
           'Operating System :: POSIX :: Linux',
           'Programming Language :: C',
           'Programming Language :: Python',
-          'Programming Language :: Python :: 2',
-          'Programming Language :: Python :: 3'],
+          'Programming Language :: Python :: 3',
+          'Programming Language :: Python :: 3 :: Only'],
+      python_requires='>=3.9',
       keywords="otama, CBIR",
       zip_safe=False,
       )
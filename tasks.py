@@ -18,7 +18,7 @@ def install(ctx):
 @task
 def test(ctx):
     """run unittest"""
-    run('nosetests -w test')
+    run('cd test && python -m unittest discover -v')
 
 
 @task
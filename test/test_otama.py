@@ -1,17 +1,24 @@
 import os
+import array
 import shutil
+import socket
+import stat
+import struct
+import sys
+import threading
+import time
 import unittest
-try:
-    from StringIO import StringIO
-except ImportError:
-    from io import StringIO
+from io import StringIO
 import otama
-from otama import Otama
+from otama import Otama, ShardedOtama, OtamaClient
+from otama import daemon
+from otama.daemon import OtamaServer
 
 BASE_DIR = os.path.abspath(os.path.dirname(__file__))
 DATA_DIR = os.path.join(BASE_DIR, 'data')
 CONFIG_FILE = os.path.join(BASE_DIR, 'test.conf')
-IMAGE_DIR = os.path.join(BASE_DIR, '../example/image')
+IMAGE_DIR = os.path.join(BASE_DIR, '../examples/image')
+LENA = os.path.join(IMAGE_DIR, 'lena.jpg')
 CONFIG = {
     'namespace': 'testnamespace',
     'driver': {'name': 'color', 'data_dir': DATA_DIR, 'color_weight': 0.2},
@@ -42,9 +49,109 @@ class TestOtama(unittest.TestCase):
         self.assertEqual(type(db), Otama)
         self.assertEqual(True, os.path.exists(DATA_DIR))
 
+    def test_open_with_threads(self):
+        config = dict(CONFIG, threads=4)
+        db = Otama(config)
+        self.assertEqual(4, db.threads)
+        self.assertEqual(4, config['threads'])
+
+    def test_open_with_invalid_threads(self):
+        self.assertRaises(ValueError, Otama, dict(CONFIG, threads=0))
+
+    def test_open_with_max_side(self):
+        config = dict(CONFIG, max_side=512)
+        db = Otama(config)
+        self.assertEqual(512, db.max_side)
+        self.assertRaises(ValueError, db.search, 10, __file__, max_side=-1)
+        self.assertRaises(ValueError, Otama, dict(CONFIG, max_side=-1))
+
+    def test_subinterpreters(self):
+        runners = []
+        try:
+            import _testcapi    # shares the main GIL
+            runners.append(_testcapi.run_in_subinterp)
+        except ImportError:
+            pass
+        try:
+            import _interpreters as interpreters
+        except ImportError:
+            try:
+                import _xxsubinterpreters as interpreters
+            except ImportError:
+                interpreters = None
+        if interpreters:        # one GIL per interpreter
+            def run_isolated(code):
+                interp = interpreters.create()
+                try:
+                    interpreters.run_string(interp, code)
+                finally:
+                    interpreters.destroy(interp)
+            runners.append(run_isolated)
+        if not runners:
+            self.skipTest('no subinterpreter support')
+
+        config = dict(CONFIG, database=dict(
+            CONFIG['database'], name=os.path.join(DATA_DIR, 'sub.db')))
+        out = os.path.join(DATA_DIR, 'sub.out')
+        code = '\n'.join([
+            'import sys',
+            'sys.path[:0] = %r' % sys.path,
+            'import otama',
+            'db = otama.Otama(%r)' % config,
+            'db.create_database()',
+            'id_ = db.insert(%r)' % LENA,
+            'db.pull()',
+            'hits = db.search(1, %r)' % LENA,
+            'with open(%r, "w") as f:' % out,
+            '    f.write(hits[0]["id"] == id_ and "ok" or "bad")',
+            'db.close()'])
+        for run in runners:
+            if os.path.exists(out):
+                os.remove(out)
+            run(code)
+            with open(out) as f:
+                self.assertEqual('ok', f.read())
+
+    def test_open_with_coalesce(self):
+        db = Otama(dict(CONFIG, coalesce=True))
+        self.assertEqual(1, db.coalesce)
+        db.create_database()
+        ids = db.insert_many([os.path.join(IMAGE_DIR, name)
+                              for name in ('lena.jpg', 'baboon.png')])
+        db.pull()
+        barrier = threading.Barrier(16)
+        results = []
+
+        def search():
+            barrier.wait()
+            results.append(db.search(10, LENA))
+
+        threads = [threading.Thread(target=search) for _ in range(16)]
+        otama.trace_start()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        scans = [ev for ev in otama.trace_stop() if ev['name'] == 'search']
+        self.assertEqual(16, len(results))
+        for hits in results:
+            self.assertEqual(ids[0], hits[0]['id'])
+            self.assertEqual(results[0], hits)
+        # the callers shared scans
+        self.assertLess(len(scans), 16)
+        self.assertRaises(ValueError, ShardedOtama,
+                          [dict(c, coalesce=1) for c in SHARD_CONFIGS])
+        self.assertRaises(ValueError, ShardedOtama,
+                          [dict(c, attrs_file=os.path.join(DATA_DIR, 'attrs'))
+                           for c in SHARD_CONFIGS])
+
     def test_close(self):
         self.assertEqual(None, self.db.close())
 
+    def test_error(self):
+        self.db.close()
+        self.assertRaises(otama.OtamaError, self.db.search, 10, __file__)
+
     def test_create_database(self):
         self.assertEqual(None, self.db.create_database())
 
@@ -57,9 +164,371 @@ class TestOtama(unittest.TestCase):
     def test_vacuum_index(self):
         self.assertEqual(None, self.db.vacuum_index())
 
+    def test_vacuum_index_background(self):
+        job = self.db.vacuum_index(background=True)
+        self.assertEqual(True, job.wait())
+        self.assertEqual('done', job.state)
+        self.assertEqual(False, job.cancel())
+
+    def test_vacuum_index_background_discarded(self):
+        self.db.vacuum_index(background=True)
+        id = self.db.insert(os.path.join(IMAGE_DIR, 'lena.jpg'))
+        self.assertEqual(True, self.db.exists(id))
+
+    def test_log_sink(self):
+        records = []
+        otama.set_log_level(otama.LOG_LEVEL_NOTICE)
+        otama.set_log_sink(records.extend)
+        try:
+            self.db.vacuum_index(background=True).wait()
+        finally:
+            otama.set_log_sink(otama.log_to_logging)
+            otama.set_log_level(otama.LOG_LEVEL_ERROR)
+        self.assertEqual([(otama.LOG_LEVEL_NOTICE, 'background vacuum_index done')],
+                         [(level, message) for level, _, message in records])
+
+    def test_log_sink_disposing_raw(self):
+        lena = {'file': os.path.join(IMAGE_DIR, 'lena.jpg')}
+        raws = [self.db.feature_raw(lena), self.db.feature_raw(lena)]
+        otama.set_log_level(otama.LOG_LEVEL_NOTICE)
+        otama.set_log_sink(lambda records: raws[1].dispose())
+        try:
+            job = self.db.vacuum_index(background=True)
+            while job.state in ('running', 'swapping'):
+                time.sleep(0.01)
+            # the pending record reaches the sink once raws[0] is let go
+            self.assertAlmostEqual(1.0, self.db.similarity({'raw': raws[0]}, {'raw': raws[0]}), 3)
+        finally:
+            otama.set_log_sink(otama.log_to_logging)
+            otama.set_log_level(otama.LOG_LEVEL_ERROR)
+
+    def test_trace(self):
+        otama.trace_start()
+        self.db.pull()
+        events = otama.trace_stop()
+        self.assertEqual(['pull'], [ev['name'] for ev in events])
+        self.assertEqual('X', events[0]['ph'])
+        self.assertEqual([], otama.trace_stop())
+
+    def test_insert_with_invalid_attrs(self):
+        self.assertRaises(TypeError, self.db.insert, __file__,
+                          attrs={'tenant': 'foo'})
+
+    def test_search_where_unknown_attribute(self):
+        self.db.create_database()
+        self.db.insert(LENA, attrs={'tenant': 42})
+        self.db.pull()
+        self.assertEqual(1, len(self.db.search(10, LENA, where={'tenant': 42})))
+        self.assertEqual((), self.db.search(10, LENA, where={'category': 42}))
+
+    def test_search_where(self):
+        self.db.create_database()
+        images = [os.path.join(IMAGE_DIR, name) for name in
+                  ('lena.jpg', 'lena-affine.jpg', 'lena-768x768.jpg')]
+        ids = [self.db.insert(f, attrs={'tenant': i % 2})
+               for i, f in enumerate(images)]
+        self.db.pull()
+        hits = self.db.search(10, images[0], where={'tenant': 0})
+        self.assertEqual(sorted([ids[0], ids[2]]),
+                         sorted(hit['id'] for hit in hits))
+        hits = self.db.search(10, images[0], where={'tenant': 1})
+        self.assertEqual([ids[1]], [hit['id'] for hit in hits])
+
+        # remove() drops the attributes along with the id
+        self.db.remove(ids[1])
+        self.assertEqual(ids[1], self.db.insert(images[1]))
+        self.db.pull()
+        self.assertEqual((), self.db.search(10, images[0],
+                                            where={'tenant': 1}))
+
+    def test_search_where_mostly_unattributed(self):
+        self.db.create_database()
+        with open(LENA, 'rb') as f:
+            lena = f.read()
+        # copies of lena without attributes crowd out the one match;
+        # decoders ignore the bytes after the end of the JPEG
+        self.db.insert_many([lena + b'%04d' % i for i in range(60)])
+        baboon = self.db.insert(os.path.join(IMAGE_DIR, 'baboon.png'),
+                                attrs={'tenant': 1})
+        self.db.pull()
+        hits = self.db.search(1, LENA, where={'tenant': 1})
+        self.assertEqual([baboon], [hit['id'] for hit in hits])
+
+    def test_search_where_after_reopen(self):
+        config = dict(CONFIG, attrs_file=os.path.join(DATA_DIR, 'attrs'))
+        images = [os.path.join(IMAGE_DIR, name) for name in
+                  ('lena.jpg', 'lena-affine.jpg', 'lena-768x768.jpg')]
+        db = Otama(config)
+        db.create_database()
+        ids = [db.insert(f, attrs={'tenant': 0}) for f in images]
+        db.set_attributes(ids[1], {'tenant': 1})
+        db.remove(ids[2])
+        db.close()
+        with open(config['attrs_file'], 'ab') as f:
+            f.write(b'junk!')       # a record torn by a crash
+        db = Otama(config)
+        # no-ops where the database was kept; the attributes come back
+        # from attrs_file either way
+        self.assertEqual(tuple(ids), db.insert_many(images))
+        db.pull()
+        self.assertEqual([ids[0]], [hit['id'] for hit in
+                                    db.search(10, LENA, where={'tenant': 0})])
+        self.assertEqual([ids[1]], [hit['id'] for hit in
+                                    db.search(10, LENA, where={'tenant': 1})])
+        db.set_attributes(ids[2], {'tenant': 1})
+        db.close()
+        db = Otama(config)
+        db.insert_many(images)
+        db.pull()
+        self.assertEqual(sorted(ids[1:]), sorted(
+            hit['id'] for hit in db.search(10, LENA, where={'tenant': 1})))
+        db.close()
+
+    def test_search_with_keywords(self):
+        self.db.create_database()
+        id_ = self.db.insert(data=LENA)
+        self.db.pull()
+        self.assertEqual([id_], [hit['id'] for hit in
+                                 self.db.search(num=10, data=LENA)])
+        self.assertRaises(TypeError, self.db.search, 10, data=__file__,
+                          num=10)
+        self.assertRaises(TypeError, self.db.search, 10, image=__file__)
+
+    def test_feature_set(self):
+        query = {'file': os.path.join(IMAGE_DIR, 'lena.jpg')}
+        with self.db.feature_set([query]) as fs:
+            fs.extend([query])
+            self.assertEqual(2, len(fs))
+            sims = fs.similarity(query)
+            self.assertEqual(2, len(sims))
+            self.assertAlmostEqual(sims[0], sims[1])
+        self.assertEqual(0, len(fs))
+        self.assertEqual((), fs.similarity(query))
+
+    def test_similarity_with_buffer(self):
+        with open(os.path.join(IMAGE_DIR, 'lena.jpg'), 'rb') as f:
+            data = f.read()
+        self.assertAlmostEqual(
+            self.db.similarity({'data': data}, {'data': data}),
+            self.db.similarity({'data': data},
+                               {'data': memoryview(bytearray(data))}))
+
+    def test_similarity_with_buffer_not_bytes(self):
+        with open(os.path.join(IMAGE_DIR, 'lena.jpg'), 'rb') as f:
+            data = f.read()
+        floats = array.array('f', [0.0] * 16)
+        self.assertRaises(TypeError, self.db.similarity,
+                          {'data': data}, {'data': floats})
+        self.assertRaises(TypeError, self.db.search, 10, {'data': floats})
+        self.assertRaises(TypeError, self.db.similarity, {'data': data},
+                          {'data': memoryview(bytearray(data))[::2]})
+
+    def test_insert_with_dedup(self):
+        config = dict(CONFIG, dedup_file=os.path.join(DATA_DIR, 'dedup'))
+        filename = os.path.join(IMAGE_DIR, 'lena.jpg')
+        db = Otama(config)
+        db.create_database()
+        id_ = db.insert(filename, dedup=True)
+        self.assertEqual((id_, id_), db.insert_many([filename] * 2, dedup=True))
+        self.assertEqual({'hits': 2, 'misses': 1, 'entries': 1},
+                         db.dedup_stats())
+        db.close()
+        db = Otama(config)
+        self.assertEqual(1, db.dedup_stats()['entries'])
+        self.assertEqual(id_, db.insert(filename, dedup=True))
+
+    def test_insert_with_dedup_torn_file(self):
+        config = dict(CONFIG, dedup_file=os.path.join(DATA_DIR, 'dedup'))
+        db = Otama(config)
+        db.create_database()
+        db.insert(os.path.join(IMAGE_DIR, 'lena.jpg'), dedup=True)
+        db.close()
+        with open(config['dedup_file'], 'ab') as f:
+            f.write(b'junk!')       # a record torn by a crash
+        db = Otama(config)
+        baboon = db.insert(os.path.join(IMAGE_DIR, 'baboon.png'), dedup=True)
+        db.close()
+        self.assertEqual(0, os.path.getsize(config['dedup_file']) % 32)
+        db = Otama(config)
+        self.assertEqual(2, db.dedup_stats()['entries'])
+        self.assertEqual(baboon, db.insert(os.path.join(IMAGE_DIR, 'baboon.png'),
+                                           dedup=True))
+        self.assertEqual(2, db.dedup_stats()['entries'])
+        db.close()
+
+    def test_insert_many_same_data(self):
+        with open(os.path.join(IMAGE_DIR, 'lena.jpg'), 'rb') as f:
+            data = f.read()
+        ids = self.db.insert_many([data, bytearray(data)], dedup=True)
+        self.assertEqual(1, len(set(ids)))
+        self.assertEqual(True, self.db.exists(ids[0]))
+        self.assertEqual({'hits': 1, 'misses': 1, 'entries': 1},
+                         self.db.dedup_stats())
+        self.assertRaises(TypeError, self.db.insert, array.array('f', [0.0]))
+
     def test_has_libotama_version_string(self):
         self.assertEqual(str, type(otama.__libotama_version__))
 
+SHARD_CONFIGS = [
+    {'namespace': 'shard%d' % i,
+     'driver': {'name': 'color', 'data_dir': DATA_DIR, 'color_weight': 0.2},
+     'database': {'driver': 'sqlite3',
+                  'name': os.path.join(DATA_DIR, 'shard%d.db' % i)}}
+    for i in range(2)]
+
+
+class TestShardedOtama(unittest.TestCase):
+
+    def setUp(self):
+        if not os.path.exists(DATA_DIR):
+            os.mkdir(DATA_DIR)
+        self.db = ShardedOtama(SHARD_CONFIGS)
+        self.db.create_database()
+
+    def tearDown(self):
+        shutil.rmtree(DATA_DIR)
+
+    def test_open(self):
+        self.assertEqual(type(self.db), ShardedOtama)
+        self.assertEqual(2, self.db.shards)
+
+    def test_open_without_config(self):
+        self.assertRaises(ValueError, ShardedOtama, [])
+
+    def test_close(self):
+        self.assertEqual(None, self.db.close())
+
+    def test_pull(self):
+        self.assertEqual(None, self.db.pull())
+
+    def test_search_empty(self):
+        self.db.pull()
+        self.assertEqual((), self.db.search(5, LENA))
+
+    def test_search_merges_shards(self):
+        files = [os.path.join(IMAGE_DIR, f) for f in sorted(os.listdir(IMAGE_DIR))]
+        single = Otama(CONFIG)
+        single.create_database()
+        for f in files:
+            self.assertEqual(single.insert(f), self.db.insert(f))
+        single.pull()
+        self.db.pull()
+        query = os.path.join(IMAGE_DIR, 'lena.jpg')
+        for num in (3, len(files)):
+            expect = single.search(num, query)
+            results = self.db.search(num, query)
+            self.assertEqual(num, len(results))
+            self.assertEqual([r['similarity'] for r in expect],
+                             [r['similarity'] for r in results])
+            self.assertEqual(set(r['id'] for r in expect),
+                             set(r['id'] for r in results))
+        single.close()
+
+    def test_search_with_timeout(self):
+        self.db.pull()
+        self.assertEqual(((), True), self.db.search(5, LENA, timeout=5.0))
+        id_ = self.db.insert(LENA)
+        self.db.pull()
+        results, complete = self.db.search(5, LENA, timeout=5.0)
+        self.assertEqual(True, complete)
+        self.assertEqual([id_], [hit['id'] for hit in results])
+        self.assertEqual(None, self.db.cancel())
+
+    def test_search_with_timeout_incomplete(self):
+        for f in sorted(os.listdir(IMAGE_DIR)):
+            self.db.insert(os.path.join(IMAGE_DIR, f))
+        self.db.pull()
+        query = os.path.join(IMAGE_DIR, 'lena.jpg')
+        results, complete = self.db.search(5, query, timeout=0)
+        self.assertEqual(False, complete)
+        self.assertEqual(tuple, type(results))
+        self.assertTrue(len(results) <= 5)
+        results, complete = self.db.search(5, query, timeout=5.0)
+        self.assertEqual(True, complete)
+        self.assertEqual(5, len(results))
+
+
+    def test_search_with_timeout_skips_abandoned_scans(self):
+        self.db.pull()
+        self.assertEqual((), self.db.search(5, LENA, timeout=None))
+        otama.trace_start()
+        for _ in range(20):
+            self.db.search(5, LENA, timeout=0)
+        self.db.close()     # waits for the jobs left running
+        scans = [ev for ev in otama.trace_stop() if ev['name'] == 'shard search']
+        self.assertTrue(len(scans) < 20 * self.db.shards // 2)
+
+
+class TestOtamaDaemon(unittest.TestCase):
+
+    def setUp(self):
+        if not os.path.exists(DATA_DIR):
+            os.mkdir(DATA_DIR)
+        Otama(CONFIG).create_database()
+        self.server = OtamaServer(os.path.join(DATA_DIR, 'otama.sock'), CONFIG)
+        self.thread = threading.Thread(target=self.server.serve_forever)
+        self.thread.start()
+        self.client = OtamaClient(self.server.server_address)
+
+    def tearDown(self):
+        self.client.close()
+        self.server.shutdown()
+        self.thread.join()
+        self.server.server_close()
+        shutil.rmtree(DATA_DIR)
+
+    def test_search(self):
+        self.client.pull()
+        self.assertEqual((), self.client.search(10, LENA, where={'tenant': 42}))
+        self.assertRaises(TypeError, self.client.insert, __file__,
+                          attrs={'tenant': 'foo'})
+
+    def test_batch(self):
+        with self.client.batch() as results:
+            self.client.pull()
+            self.client.search(10, LENA)
+        self.assertEqual([None, ()], results)
+
+    def test_batch_per_thread(self):
+        other = []
+        with self.client.batch() as results:
+            self.client.exists('0' * 40)
+            t = threading.Thread(
+                target=lambda: other.append(self.client.exists('1' * 40)))
+            t.start()
+            t.join()
+        self.assertEqual([False], other)
+        self.assertEqual([False], results)
+
+    def test_socket(self):
+        path = self.server.server_address
+        self.assertEqual(0o600, stat.S_IMODE(os.stat(path).st_mode))
+        self.assertRaises(OSError, OtamaServer, path, CONFIG)
+        self.assertRaises(OSError, self.client.search, 10, '/nonexistent.jpg')
+
+        stale = os.path.join(DATA_DIR, 'stale.sock')
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.bind(stale)
+        sock.close()
+        OtamaServer(stale, CONFIG).server_close()
+
+    def test_oversized_frame(self):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(self.server.server_address)
+        sock.sendall(struct.pack('>I', daemon.MAX_FRAME + 1))
+        self.assertEqual(b'', sock.recv(1))
+        sock.close()
+
+    def test_bad_frame(self):
+        nested = b'l\x00\x00\x00\x01' * (daemon.MAX_DEPTH + 2) + b'N'
+        for payload in (b'i' + struct.pack('>q', 1), nested):
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(self.server.server_address)
+            sock.sendall(struct.pack('>I', len(payload)) + payload)
+            self.assertEqual(b'', sock.recv(1))
+            sock.close()
+        self.assertEqual(None, self.client.pull())
+
 
 class TestOtamaWithLevelDB(unittest.TestCase):
 